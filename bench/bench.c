@@ -0,0 +1,385 @@
+/*
+ * Headless replay benchmark: runs recorded server traffic through ircl's
+ * own receive, parse, state, log and scrollback code with the terminal
+ * pointed at /dev/null, and reports throughput, per-line latency,
+ * allocations per line and peak RSS.
+ *
+ * usage: bench [-n repeat] [-l log file] [-z] [-p [-o]] corpus ...
+ *
+ * A corpus holds raw server lines, one per line. A line may start with an
+ * epoch timestamp ("1700000000.250 :nick!u@h PRIVMSG ..."), which is
+ * stripped and used to report the rate the traffic was recorded at.
+ *
+ * "msg allocs" counts allocations made while handling PRIVMSG lines once
+ * the first pass has warmed up the nick registry and scrollback; with -z
+ * any at all make the run fail.
+ *
+ * With -p only parse_irc_msg(), parse_tags() and the handler lookup run,
+ * with no handlers, state or output, and the report is parsed messages per
+ * second, e.g.
+ *
+ *   bench/bench -p -n 200 bench/backlog.irc bench/netsplit.irc
+ *
+ * -p -o times the parser this one replaced instead, a copy of the old
+ * parsesrv() split and strcmp chain, over the same corpora.
+ */
+#include "../ircl.h"
+#include <sys/resource.h>
+
+static unsigned long bench_allocs, bench_bytes;
+static unsigned long msg_allocs_total; /* for -z */
+
+static void *bench_malloc(size_t n) {
+  bench_allocs++;
+  bench_bytes += n;
+  return malloc(n);
+}
+
+static void *bench_calloc(size_t n, size_t size) {
+  bench_allocs++;
+  bench_bytes += n * size;
+  return calloc(n, size);
+}
+
+static void *bench_realloc(void *p, size_t n) {
+  bench_allocs++;
+  bench_bytes += n;
+  return realloc(p, n);
+}
+
+static char *bench_strdup(const char *s) {
+  bench_allocs++;
+  bench_bytes += strlen(s) + 1;
+  return strdup(s);
+}
+
+/* count every allocation ircl.c makes */
+#define malloc(n) bench_malloc(n)
+#define calloc(n, s) bench_calloc(n, s)
+#define realloc(p, n) bench_realloc(p, n)
+#define strdup(s) bench_strdup(s)
+#define main ircl_main
+#include "../ircl.c"
+#undef main
+#undef malloc
+#undef calloc
+#undef realloc
+#undef strdup
+
+#define BENCH_CHUNK 16384 /* bytes per simulated read(), as a batch */
+
+static int cmp_long(const void *a, const void *b) {
+  long x = *(const long *)a, y = *(const long *)b;
+
+  return (x > y) - (x < y);
+}
+
+static long elapsed_ns(const struct timespec *a, const struct timespec *b) {
+  return (b->tv_sec - a->tv_sec) * 1000000000L + (b->tv_nsec - a->tv_nsec);
+}
+
+/* a leading "<digits>[.<digits>] " is a capture timestamp */
+static char *strip_timestamp(char *line, double *ts) {
+  char *p = line;
+
+  while (isdigit((unsigned char)*p))
+    p++;
+  if (p == line)
+    return line;
+  if (*p == '.') {
+    p++;
+    while (isdigit((unsigned char)*p))
+      p++;
+  }
+  if (*p != ' ')
+    return line;
+  *ts = strtod(line, NULL);
+  return p + 1;
+}
+
+/* the corpus as an array of lines, timestamps stripped */
+static char **load_corpus(const char *path, size_t *count, double *first_ts,
+                          double *last_ts) {
+  FILE *f;
+  char *line = NULL, *msg;
+  size_t cap = 0, nlines = 0;
+  ssize_t n;
+  double ts;
+  char **lines = NULL;
+
+  *first_ts = *last_ts = -1;
+  if (!(f = fopen(path, "r")))
+    eprint("bench: %s:", path);
+  while ((n = getline(&line, &cap, f)) != -1) {
+    while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+      line[--n] = '\0';
+    ts = -1;
+    msg = strip_timestamp(line, &ts);
+    if (ts >= 0) {
+      if (*first_ts < 0)
+        *first_ts = ts;
+      *last_ts = ts;
+    }
+    if (!*msg)
+      continue;
+    if (nlines % 1024 == 0)
+      lines = realloc(lines, (nlines + 1024) * sizeof(char *));
+    lines[nlines++] = strdup(msg);
+  }
+  free(line);
+  fclose(f);
+  *count = nlines;
+  return lines;
+}
+
+static void free_corpus(char **lines, size_t nlines) {
+  size_t i;
+
+  for (i = 0; i < nlines; i++)
+    free(lines[i]);
+  free(lines);
+}
+
+static void trim(char *s) {
+  char *e;
+
+  e = s + strlen(s) - 1;
+  while (isspace(*e) && e > s)
+    e--;
+  *(e + 1) = '\0';
+}
+
+/* -o: parsesrv() as it was before parse_irc_msg() and the dispatch tables,
+ * with the handlers cut out. Returns 0 with no command, 1 for a command it
+ * had a branch for and -1 for one that fell through to the default. */
+static int old_parsesrv(char *cmd) {
+  char *usr, *par, *txt;
+
+  usr = host;
+  if (!cmd || !*cmd)
+    return 0;
+  if (cmd[0] == ':') {
+    usr = cmd + 1;
+    cmd = skip(usr, ' ');
+    if (cmd[0] == '\0')
+      return 0;
+    skip(usr, '!');
+  }
+  skip(cmd, '\r');
+  par = skip(cmd, ' ');
+  txt = skip(par, ':');
+  trim(par);
+  UNUSED(txt);
+
+  if (!strcmp("PONG", cmd))
+    return 1;
+  if (!strcmp("PRIVMSG", cmd))
+    return 1;
+  else if (!strcmp("PING", cmd))
+    return 1;
+  else {
+    if (strcmp(cmd, "JOIN") == 0)
+      return 1;
+    else if ((strcmp(cmd, "QUIT") == 0) || (strcmp(cmd, "PART") == 0))
+      return 1;
+    else if (strcmp(cmd, "NICK") == 0)
+      return 1;
+    else if (strcmp(cmd, "NOTICE") == 0)
+      return 1;
+    else if (strcmp(cmd, "MODE") == 0)
+      return 1;
+    else if (strcmp(cmd, "001") == 0)
+      return 1;
+    else if (strcmp(cmd, "366") == 0)
+      return 1;
+    else if (strcmp(cmd, "332") == 0)
+      return 1;
+    else if (strcmp(cmd, "315") == 0)
+      return 1;
+    else if (strcmp(cmd, "352") == 0)
+      return 1;
+    else if (strcmp(cmd, "353") == 0)
+      return 1;
+    else if (strcmp(cmd, "306") == 0)
+      return 1;
+    else if (strcmp(cmd, "305") == 0)
+      return 1;
+  }
+  return -1;
+}
+
+/* -p: split each line and find its handler, and nothing else */
+static void run_parse(const char *path, int repeat, bool old) {
+  static char buf[RECV_BUF_SIZE];
+  struct irc_msg m;
+  struct timespec t0, t1;
+  size_t nlines, i, len, *lens, parsed = 0, handled = 0;
+  double first_ts, last_ts, secs;
+  char **lines;
+  int r, h;
+
+  lines = load_corpus(path, &nlines, &first_ts, &last_ts);
+  if (nlines == 0)
+    return;
+  lens = malloc(nlines * sizeof *lens);
+  for (i = 0; i < nlines; i++)
+    lens[i] = strlen(lines[i]);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (r = 0; r < repeat; r++) {
+    for (i = 0; i < nlines; i++) {
+      /* parsing is destructive: work on a copy, as on rbuf */
+      len = lens[i] < sizeof buf - 1 ? lens[i] : sizeof buf - 1;
+      memcpy(buf, lines[i], len);
+      buf[len] = '\0';
+      if (old) {
+        if ((h = old_parsesrv(buf))) {
+          parsed++;
+          handled += h > 0;
+        }
+        continue;
+      }
+      if (!parse_irc_msg(buf, &m))
+        continue;
+      m.batch = NULL;
+      parse_tags(&m);
+      parsed++;
+      handled += lookup_handler(m.cmd) != NULL;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  secs = elapsed_ns(&t0, &t1) / 1e9;
+  printf("%-20s %8zu %11.0f %8.1f %8.1f\n", basename((char *)path),
+         nlines * repeat, parsed / secs, secs * 1e9 / (nlines * repeat),
+         parsed ? 100.0 * handled / parsed : 0);
+  free(lens);
+  free_corpus(lines, nlines);
+}
+
+static void run_corpus(const char *path, int repeat) {
+  char **lines;
+  size_t nlines, i, nsamples = 0, len, chunk = 0;
+  long *samples = NULL, total_ns = 0;
+  unsigned long allocs, bytes, before, msg_allocs = 0, msg_lines = 0;
+  bool steady, is_msg;
+  double first_ts, last_ts;
+  struct timespec t0, t1;
+  int r;
+
+  lines = load_corpus(path, &nlines, &first_ts, &last_ts);
+  if (nlines == 0)
+    return;
+  samples = malloc(nlines * repeat * sizeof(long));
+
+  allocs = bench_allocs;
+  bytes = bench_bytes;
+  for (r = 0; r < repeat; r++) {
+    steady = r > 0 || repeat == 1;
+    for (i = 0; i < nlines; i++) {
+      /* the same path as srv_ready(): append to rbuf, frame, dispatch */
+      len = strlen(lines[i]);
+      is_msg = strstr(lines[i], " PRIVMSG ") != NULL;
+      before = bench_allocs;
+      if (rbuf.end + len + 2 > RECV_BUF_SIZE)
+        rbuf.start = rbuf.end = rbuf.scan = 0;
+      memcpy(rbuf.buf + rbuf.end, lines[i], len);
+      memcpy(rbuf.buf + rbuf.end + len, "\r\n", 2);
+      rbuf.end += len + 2;
+      clock_gettime(CLOCK_MONOTONIC, &t0);
+      recv_frame();
+      chunk += len + 2;
+      if (chunk >= BENCH_CHUNK) {
+        render_flush(); /* the loop would go back to sleep here */
+        chunk = 0;
+      }
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      if (steady && is_msg) {
+        msg_lines++;
+        msg_allocs += bench_allocs - before;
+      }
+      samples[nsamples] = elapsed_ns(&t0, &t1);
+      total_ns += samples[nsamples++];
+    }
+    render_flush();
+  }
+  allocs = bench_allocs - allocs;
+  bytes = bench_bytes - bytes;
+
+  qsort(samples, nsamples, sizeof(long), cmp_long);
+  printf("%-20s %8zu %11.0f %8.2f %8.2f %8.3f %9.1f %10.3f",
+         basename((char *)path), nsamples, nsamples / (total_ns / 1e9),
+         samples[nsamples / 2] / 1e3, samples[nsamples * 99 / 100] / 1e3,
+         (double)allocs / nsamples, (double)bytes / nsamples,
+         msg_lines ? (double)msg_allocs / msg_lines : 0);
+  msg_allocs_total += msg_allocs;
+  if (last_ts > first_ts)
+    printf("  (recorded at %.0f lines/s)", nlines / (last_ts - first_ts));
+  printf("\n");
+
+  free_corpus(lines, nlines);
+  free(samples);
+}
+
+int main(int argc, char *argv[]) {
+  struct rusage ru;
+  const char *log = "/dev/null";
+  int i, repeat = 1;
+  bool zero = false, parse_only = false, old = false;
+
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc)
+      repeat = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-l") && i + 1 < argc)
+      log = argv[++i];
+    else if (!strcmp(argv[i], "-z"))
+      zero = true;
+    else if (!strcmp(argv[i], "-p"))
+      parse_only = true;
+    else if (!strcmp(argv[i], "-o"))
+      old = true;
+    else
+      break;
+  }
+  if (i == argc || repeat < 1 || (old && !parse_only))
+    eprint("usage: bench [-n repeat] [-l log file] [-z] [-p [-o]] corpus "
+           "...\n");
+
+  /* everything main() would set up, minus the terminal and the network */
+  strlcpy(default_nick, "me", sizeof default_nick);
+  if (!(rl_outstream = fopen("/dev/null", "w")))
+    eprint("bench: /dev/null:");
+  RL_SETSTATE(RL_STATE_DONE); /* no prompt to save and restore */
+  rl_set_prompt("> ");        /* update_prompt() shows the send queue */
+  initialize_logging(log);
+  initialize_casemap();
+  initialize_nicks();
+  initialize_channels();
+  highlight_build(); /* our nick only; no keyword file */
+  initialize_scrollback();
+  initialize_dispatch();
+  srv = open("/dev/null", O_WRONLY); /* PONGs and the like go nowhere */
+  conn = CONN_ONLINE;
+  clock_gettime(CLOCK_MONOTONIC, &sendq.refilled);
+
+  if (parse_only) {
+    printf("%-20s %8s %11s %8s %8s\n", "corpus", "lines", "msgs/s",
+           "ns/msg", "handled%");
+    for (; i < argc; i++)
+      run_parse(argv[i], repeat, old);
+    return 0;
+  }
+  printf("%-20s %8s %11s %8s %8s %8s %9s %10s\n", "corpus", "lines",
+         "lines/s", "p50 us", "p99 us", "allocs", "bytes", "msg allocs");
+  for (; i < argc; i++)
+    run_corpus(argv[i], repeat);
+  log_flush();
+  getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+  printf("peak RSS: %ld KB\n", ru.ru_maxrss / 1024);
+#else
+  printf("peak RSS: %ld KB\n", ru.ru_maxrss);
+#endif
+  if (zero && msg_allocs_total)
+    eprint("bench: %lu allocations handling PRIVMSG in steady state\n",
+           msg_allocs_total);
+  return 0;
+}
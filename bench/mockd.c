@@ -0,0 +1,1030 @@
+/*
+ * mockd: a stand-in IRC server for soak testing ircl on one box.
+ *
+ * usage: mockd [-p port] [-s] [-C cert file] [-c channels] [-u users]
+ *              [-r msgs/s] [-j churn/s] [-x split secs] [-w extra names]
+ *              [-b read bytes/s] [-k kill secs] [-i ping ms] [-t secs] [-q]
+ *
+ * Clients are registered as soon as they send NICK and USER, then put in
+ * channels #load0 .. #load<channels-1>, each with <users> simulated nicks.
+ * From then on the server generates chatter, join/part churn and periodic
+ * netsplits, pads every NAMES and WHO reply, and can read from the client
+ * slowly to push back on its send path. It PINGs every client to time the
+ * PONGs, and watches how the client paces its own lines. It prints a
+ * report every second and a summary on exit.
+ *
+ * It offers the IRCv3 capabilities batch, server-time, message-tags and
+ * draft/chathistory. Clients that ask for server-time get a time tag on
+ * every line. Each channel keeps its last HISTORY_RING messages, including
+ * those sent while nobody was connected. CHATHISTORY LATEST, AFTER and
+ * BEFORE are answered from them, in a chathistory BATCH. With -k, that
+ * covers fetching what was missed across a reconnect.
+ *
+ * With -s it speaks TLS only, using a throwaway self-signed certificate
+ * for localhost. -C writes that certificate out so the client can trust it:
+ *
+ *   bench/mockd -s -C /tmp/mockd.pem &
+ *   SSL_CERT_FILE=/tmp/mockd.pem ./ircl -s -h localhost -p 6697
+ */
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#define UNUSED(x) (void)(x)
+#define MOCK_HOST "irc.mock"
+#define MAX_LISTEN 4
+#define MAX_CLIENTS 64
+#define IN_BUF_SIZE 8192
+#define LINE_BUF_SIZE 1024
+#define NAMES_LINE 400      /* bytes of nicks per 353 line */
+#define TICK_MS 10          /* traffic is generated in slices this long */
+#define SENDQ_MAX (8 << 20) /* a client this far behind gets dropped */
+#define SPLIT_MS 3000       /* split users come back after this long */
+#define PACE_WINDOW_MS 2000 /* client lines are counted per window */
+#define PACE_RING 256
+#define SLOW_RCVBUF 4096 /* with -b, so the client feels it quickly */
+#define HISTORY_RING 256 /* messages kept per channel */
+#define HISTORY_MAX 100  /* most CHATHISTORY sends at once */
+#define CAPS "batch server-time message-tags draft/chathistory"
+
+enum { CAP_BATCH = 1, CAP_TIME = 2, CAP_TAGS = 4, CAP_HISTORY = 8 };
+
+struct client {
+  LIST_ENTRY(client) link;
+  int fd;
+  SSL *ssl;
+  bool handshake;  /* TLS handshake in progress */
+  bool registered; /* sent 001 */
+  bool has_user;
+  bool cap_negotiating; /* registration waits for CAP END */
+  unsigned caps;
+  unsigned batch_seq;
+  const char *closing; /* drop after the output drains */
+  char nick[64];
+  char in[IN_BUF_SIZE];
+  size_t inlen;
+  char *out;
+  size_t outlen, outcap;
+  bool *joined; /* per #load channel */
+  double connected, ping_sent, read_budget;
+  unsigned ping_seq;
+  bool ping_out;
+  double pace[PACE_RING]; /* times of the client's latest lines */
+  unsigned pace_head, pace_count;
+  double last_line;
+};
+
+struct stats {
+  unsigned long lines_out, bytes_out, lines_in, accepted, dropped, killed;
+  unsigned long max_window; /* most client lines in any PACE_WINDOW_MS */
+  double min_gap;           /* shortest time between two client lines */
+  double *pong;             /* PONG round trips, ms */
+  size_t npong, pong_cap;
+};
+
+LIST_HEAD(client_list, client);
+
+static struct client_list clients = LIST_HEAD_INITIALIZER(clients);
+static int nclients = 0;
+static int listeners[MAX_LISTEN], nlisteners = 0;
+static SSL_CTX *ssl_ctx = NULL;
+static const char *port = NULL;
+static int nchan = 4, nusers = 50;
+static double msg_rate = 100, churn_rate = 2, read_rate = 0;
+static int split_secs = 0, kill_secs = 0, extra_names = 0;
+static int ping_ms = 1000;
+static bool quiet = false;
+static bool *present;    /* nchan * nusers, false while split or parted */
+static struct history {
+  long long ms[HISTORY_RING];
+  char *lines[HISTORY_RING];
+  unsigned head, count;
+} *history; /* per channel */
+static double split_end; /* when split users rejoin, 0 if none are out */
+static struct stats total, period;
+static volatile sig_atomic_t stop = 0;
+
+static const char *chatter[] = {
+    "deploy finished on all hosts",
+    "anyone else seeing timeouts from the build cache?",
+    "lgtm, merging",
+    "the quick brown fox jumps over the lazy dog",
+    "rebooting the bastion in five minutes, save your work",
+    "https://example.com/dashboards/latency?from=now-1h&to=now",
+    "ack",
+    "I think that regressed in the last release, let me bisect it",
+};
+
+static void eprint(const char *fmt, ...) {
+  va_list ap;
+
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  if (fmt[0] && fmt[strlen(fmt) - 1] == ':')
+    fprintf(stderr, " %s\n", strerror(errno));
+  exit(1);
+}
+
+static double now_ms() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static long long wall_ms() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void format_time(char *buf, size_t size, long long ms) {
+  time_t t = ms / 1000;
+  char date[32];
+
+  strftime(date, sizeof date, "%Y-%m-%dT%H:%M:%S", gmtime(&t));
+  snprintf(buf, size, "%s.%03dZ", date, (int)(ms % 1000));
+}
+
+static long long parse_time(const char *s) {
+  struct tm tm = {0};
+  int ms = 0, n = 0;
+
+  if (sscanf(s, "%d-%d-%dT%d:%d:%d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+             &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &n) != 6)
+    return -1;
+  if (s[n] == '.')
+    sscanf(s + n + 1, "%3d", &ms);
+  tm.tm_year -= 1900;
+  tm.tm_mon--;
+  return (long long)timegm(&tm) * 1000 + ms;
+}
+
+static void handle_stop(int sig) {
+  UNUSED(sig);
+  stop = 1;
+}
+
+/* a throwaway P-256 key and a self-signed certificate for localhost */
+static void initialize_tls(const char *cert_file) {
+  EVP_PKEY_CTX *kctx;
+  EVP_PKEY *key = NULL;
+  X509 *x509;
+  X509_NAME *name;
+  X509_EXTENSION *ext;
+  X509V3_CTX v3;
+  FILE *f;
+
+  if (!(kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL)) ||
+      EVP_PKEY_keygen_init(kctx) <= 0 ||
+      EVP_PKEY_CTX_set_ec_paramgen_curve_nid(kctx, NID_X9_62_prime256v1) <=
+          0 ||
+      EVP_PKEY_keygen(kctx, &key) <= 0)
+    eprint("mockd: unable to generate a key\n");
+  EVP_PKEY_CTX_free(kctx);
+
+  x509 = X509_new();
+  X509_set_version(x509, 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(x509), time(NULL));
+  X509_gmtime_adj(X509_getm_notBefore(x509), -3600);
+  X509_gmtime_adj(X509_getm_notAfter(x509), 30 * 86400L);
+  X509_set_pubkey(x509, key);
+  name = X509_get_subject_name(x509);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                             (const unsigned char *)"localhost", -1, -1, 0);
+  X509_set_issuer_name(x509, name);
+  X509V3_set_ctx(&v3, x509, x509, NULL, NULL, 0);
+  if ((ext = X509V3_EXT_conf_nid(NULL, &v3, NID_subject_alt_name,
+                                 "DNS:localhost,IP:127.0.0.1,IP:::1"))) {
+    X509_add_ext(x509, ext, -1);
+    X509_EXTENSION_free(ext);
+  }
+  if ((ext = X509V3_EXT_conf_nid(NULL, &v3, NID_basic_constraints,
+                                 "critical,CA:TRUE"))) {
+    X509_add_ext(x509, ext, -1);
+    X509_EXTENSION_free(ext);
+  }
+  if (!X509_sign(x509, key, EVP_sha256()))
+    eprint("mockd: unable to sign the certificate\n");
+
+  if (!(ssl_ctx = SSL_CTX_new(TLS_server_method())))
+    eprint("mockd: unable to create a TLS context\n");
+  SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                                SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  if (SSL_CTX_use_certificate(ssl_ctx, x509) != 1 ||
+      SSL_CTX_use_PrivateKey(ssl_ctx, key) != 1)
+    eprint("mockd: unable to use the certificate\n");
+  if (cert_file) {
+    if (!(f = fopen(cert_file, "w")))
+      eprint("mockd: %s:", cert_file);
+    PEM_write_X509(f, x509);
+    fclose(f);
+  }
+  X509_free(x509);
+  EVP_PKEY_free(key);
+}
+
+static void listen_on(const char *port) {
+  struct addrinfo hints = {.ai_family = AF_UNSPEC,
+                           .ai_socktype = SOCK_STREAM,
+                           .ai_flags = AI_PASSIVE},
+                  *res, *r;
+  int fd, on = 1, err;
+
+  if ((err = getaddrinfo("localhost", port, &hints, &res)) != 0)
+    eprint("mockd: %s\n", gai_strerror(err));
+  for (r = res; r && nlisteners < MAX_LISTEN; r = r->ai_next) {
+    if ((fd = socket(r->ai_family, r->ai_socktype, r->ai_protocol)) == -1)
+      continue;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+    if (r->ai_family == AF_INET6)
+      setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof on);
+    if (bind(fd, r->ai_addr, r->ai_addrlen) == -1 || listen(fd, 16) == -1) {
+      close(fd);
+      continue;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    listeners[nlisteners++] = fd;
+  }
+  freeaddrinfo(res);
+  if (nlisteners == 0)
+    eprint("mockd: unable to listen on localhost port %s:", port);
+}
+
+static void queue(struct client *c, const char *line, size_t len) {
+  char tagged[LINE_BUF_SIZE + 64];
+  int n;
+
+  if (c->closing)
+    return;
+  if ((c->caps & CAP_TIME) && line[0] != '@') {
+    memcpy(tagged, "@time=", 6);
+    format_time(tagged + 6, sizeof tagged - 6, wall_ms());
+    n = strlen(tagged);
+    tagged[n++] = ' ';
+    memcpy(tagged + n, line, len);
+    line = tagged;
+    len += n;
+  }
+  if (c->outlen + len > c->outcap) {
+    c->outcap = (c->outlen + len) * 2;
+    if (!(c->out = realloc(c->out, c->outcap)))
+      eprint("mockd: realloc:");
+  }
+  memcpy(c->out + c->outlen, line, len);
+  c->outlen += len;
+  total.lines_out++;
+  period.lines_out++;
+  total.bytes_out += len;
+  period.bytes_out += len;
+  if (c->outlen > SENDQ_MAX) {
+    c->closing = "SendQ exceeded"; /* what a real server would do */
+    total.dropped++;
+  }
+}
+
+static size_t format_line(char *buf, const char *fmt, va_list ap) {
+  int n = vsnprintf(buf, LINE_BUF_SIZE - 2, fmt, ap);
+
+  if (n < 0)
+    n = 0;
+  else if (n > LINE_BUF_SIZE - 3)
+    n = LINE_BUF_SIZE - 3;
+  memcpy(buf + n, "\r\n", 2);
+  return n + 2;
+}
+
+static void sendc(struct client *c, const char *fmt, ...) {
+  char buf[LINE_BUF_SIZE];
+  va_list ap;
+  size_t len;
+
+  va_start(ap, fmt);
+  len = format_line(buf, fmt, ap);
+  va_end(ap);
+  queue(c, buf, len);
+}
+
+/* a message for CHATHISTORY, whether or not anyone saw it */
+static void remember(int ch, const char *line, size_t len) {
+  struct history *h = &history[ch];
+  unsigned i = h->head++ % HISTORY_RING;
+
+  free(h->lines[i]);
+  if (!(h->lines[i] = strndup(line, len)))
+    eprint("mockd: strndup:");
+  h->ms[i] = wall_ms();
+  if (h->count < HISTORY_RING)
+    h->count++;
+}
+
+/* CHATHISTORY LATEST|AFTER|BEFORE <#load> <*|timestamp=...> <limit> */
+static void send_history(struct client *c, const char *sub, const char *chan,
+                         const char *ref, int limit) {
+  struct history *h;
+  char ts[40];
+  long long since = 0;
+  unsigned i, first, from, to, n = 0, idx[HISTORY_RING];
+  int ch;
+
+  if (!(c->caps & CAP_HISTORY) || !(c->caps & CAP_BATCH)) {
+    sendc(c, ":%s 421 %s CHATHISTORY :Unknown command", MOCK_HOST, c->nick);
+    return;
+  }
+  if (sscanf(chan, "#load%d", &ch) != 1 || ch < 0 || ch >= nchan ||
+      (strcmp(ref, "*") &&
+       (strncmp(ref, "timestamp=", 10) || (since = parse_time(ref + 10)) < 0))) {
+    sendc(c, "FAIL CHATHISTORY INVALID_PARAMS %s :Bad target or reference",
+          chan);
+    return;
+  }
+  if (limit <= 0 || limit > HISTORY_MAX)
+    limit = HISTORY_MAX;
+  h = &history[ch];
+  first = h->head - h->count;
+  for (i = first; i != h->head; i++) {
+    unsigned j = i % HISTORY_RING;
+
+    if (!strcasecmp(sub, "BEFORE") ? h->ms[j] < since : h->ms[j] > since)
+      idx[n++] = j;
+  }
+  /* AFTER starts at the oldest match, LATEST and BEFORE end at the newest */
+  from = 0;
+  to = n;
+  if (n > (unsigned)limit) {
+    if (!strcasecmp(sub, "AFTER"))
+      to = limit;
+    else
+      from = n - limit;
+  }
+  sendc(c, "BATCH +h%u chathistory %s", ++c->batch_seq, chan);
+  for (i = from; i < to; i++) {
+    format_time(ts, sizeof ts, h->ms[idx[i]]);
+    sendc(c, "@time=%s;batch=h%u %s", ts, c->batch_seq, h->lines[idx[i]]);
+  }
+  sendc(c, "BATCH -h%u", c->batch_seq);
+}
+
+/* one line to every registered client in #load<ch> */
+static void broadcast(int ch, const char *fmt, ...) {
+  char buf[LINE_BUF_SIZE];
+  struct client *c;
+  va_list ap;
+  size_t len;
+
+  va_start(ap, fmt);
+  len = format_line(buf, fmt, ap);
+  va_end(ap);
+  LIST_FOREACH(c, &clients, link) {
+    if (c->registered && c->joined[ch])
+      queue(c, buf, len);
+  }
+  if (strstr(buf, " PRIVMSG "))
+    remember(ch, buf, len - 2);
+}
+
+static const char *user_nick(int u) {
+  static char nick[32];
+
+  snprintf(nick, sizeof nick, "u%d_%d", u / nusers, u % nusers);
+  return nick;
+}
+
+/* the 353 lines for a channel, real members first then -w padding */
+static void send_names(struct client *c, const char *chan, int ch) {
+  char line[NAMES_LINE + 64];
+  size_t len = 0;
+  int u, n = ch >= 0 ? nusers + extra_names : extra_names;
+
+  for (u = -1; u < n; u++) {
+    if (u == -1)
+      len += snprintf(line + len, sizeof line - len, "@%s ", c->nick);
+    else if (ch >= 0 && u < nusers) {
+      if (!present[ch * nusers + u])
+        continue;
+      len += snprintf(line + len, sizeof line - len, "%s%s ",
+                      u % 10 == 0 ? "+" : "", user_nick(ch * nusers + u));
+    } else
+      len += snprintf(line + len, sizeof line - len, "w%d ", u);
+    if (len >= NAMES_LINE) {
+      line[len - 1] = '\0';
+      sendc(c, ":%s 353 %s = %s :%s", MOCK_HOST, c->nick, chan, line);
+      len = 0;
+    }
+  }
+  if (len) {
+    line[len - 1] = '\0';
+    sendc(c, ":%s 353 %s = %s :%s", MOCK_HOST, c->nick, chan, line);
+  }
+  sendc(c, ":%s 366 %s %s :End of /NAMES list.", MOCK_HOST, c->nick, chan);
+}
+
+static void send_who(struct client *c, const char *mask) {
+  int ch = -1, u, from = 0, to = nchan * nusers;
+
+  if (sscanf(mask, "#load%d", &ch) == 1 && ch >= 0 && ch < nchan) {
+    from = ch * nusers;
+    to = from + nusers;
+  }
+  for (u = from; u < to; u++) {
+    if (present[u])
+      sendc(c, ":%s 352 %s #load%d ~%s host%d.mock %s %s %s :0 Load User",
+            MOCK_HOST, c->nick, u / nusers, user_nick(u), u, MOCK_HOST,
+            user_nick(u), u % 7 ? "H" : "G");
+  }
+  for (u = 0; u < extra_names; u++)
+    sendc(c, ":%s 352 %s * ~w%d pad.mock %s w%d H :0 Padding", MOCK_HOST,
+          c->nick, u, MOCK_HOST, u);
+  sendc(c, ":%s 315 %s %s :End of /WHO list.", MOCK_HOST, c->nick, mask);
+}
+
+static void join_channel(struct client *c, const char *chan) {
+  int ch = -1;
+
+  if (sscanf(chan, "#load%d", &ch) != 1 || ch < 0 || ch >= nchan)
+    ch = -1;
+  else if (c->joined[ch])
+    return;
+  sendc(c, ":%s!~%s@client.mock JOIN %s", c->nick, c->nick, chan);
+  sendc(c, ":%s 332 %s %s :load channel, %d users", MOCK_HOST, c->nick, chan,
+        ch >= 0 ? nusers : 1);
+  send_names(c, chan, ch);
+  if (ch >= 0)
+    c->joined[ch] = true;
+}
+
+static void register_client(struct client *c) {
+  char chan[32];
+  int ch;
+
+  c->registered = true;
+  sendc(c, ":%s 001 %s :Welcome to the mock IRC network %s", MOCK_HOST,
+        c->nick, c->nick);
+  sendc(c, ":%s 002 %s :Your host is %s", MOCK_HOST, c->nick, MOCK_HOST);
+  sendc(c, ":%s 003 %s :This server was created just now", MOCK_HOST,
+        c->nick);
+  sendc(c, ":%s 004 %s %s mockd-1.0 iow ntklm", MOCK_HOST, c->nick,
+        MOCK_HOST);
+  sendc(c, ":%s 005 %s CASEMAPPING=rfc1459 CHANTYPES=# NICKLEN=30 "
+           "PREFIX=(ov)@+ CHATHISTORY=%d :are supported by this server",
+        MOCK_HOST, c->nick, HISTORY_MAX);
+  sendc(c, ":%s 375 %s :- %s Message of the day -", MOCK_HOST, c->nick,
+        MOCK_HOST);
+  sendc(c, ":%s 372 %s :- nothing here is real", MOCK_HOST, c->nick);
+  sendc(c, ":%s 376 %s :End of /MOTD command.", MOCK_HOST, c->nick);
+  for (ch = 0; ch < nchan; ch++) {
+    snprintf(chan, sizeof chan, "#load%d", ch);
+    join_channel(c, chan);
+  }
+}
+
+/* CAP LS, REQ and END; until END, registration waits */
+static void handle_cap(struct client *c, const char *sub, char *caps) {
+  unsigned want = 0;
+  char *name;
+  const char *who = *c->nick ? c->nick : "*";
+
+  if (!strcasecmp(sub, "LS")) {
+    c->cap_negotiating = !c->registered;
+    sendc(c, ":%s CAP %s LS :%s", MOCK_HOST, who, CAPS);
+  } else if (!strcasecmp(sub, "REQ") && caps) {
+    char req[LINE_BUF_SIZE];
+
+    snprintf(req, sizeof req, "%s", caps);
+    for (name = strtok(caps, " "); name; name = strtok(NULL, " ")) {
+      if (!strcmp(name, "batch"))
+        want |= CAP_BATCH;
+      else if (!strcmp(name, "server-time"))
+        want |= CAP_TIME;
+      else if (!strcmp(name, "message-tags"))
+        want |= CAP_TAGS;
+      else if (!strcmp(name, "draft/chathistory"))
+        want |= CAP_HISTORY;
+      else
+        break;
+    }
+    if (name) {
+      sendc(c, ":%s CAP %s NAK :%s", MOCK_HOST, who, req);
+      return;
+    }
+    c->caps |= want;
+    sendc(c, ":%s CAP %s ACK :%s", MOCK_HOST, who, req);
+  } else if (!strcasecmp(sub, "END")) {
+    c->cap_negotiating = false;
+    if (*c->nick && c->has_user && !c->registered)
+      register_client(c);
+  }
+}
+
+/* the client sent a line; count it against the pacing window */
+static void pace_line(struct client *c, double t) {
+  if (c->last_line && (total.min_gap == 0 || t - c->last_line < total.min_gap))
+    total.min_gap = t - c->last_line;
+  c->last_line = t;
+  while (c->pace_count &&
+         t - c->pace[(c->pace_head - c->pace_count) % PACE_RING] >
+             PACE_WINDOW_MS)
+    c->pace_count--;
+  c->pace[c->pace_head++ % PACE_RING] = t;
+  if (c->pace_count < PACE_RING)
+    c->pace_count++;
+  if (c->pace_count > total.max_window)
+    total.max_window = c->pace_count;
+}
+
+static void pong_sample(double ms) {
+  if (total.npong == total.pong_cap) {
+    total.pong_cap = total.pong_cap ? total.pong_cap * 2 : 256;
+    if (!(total.pong = realloc(total.pong, total.pong_cap * sizeof(double))))
+      eprint("mockd: realloc:");
+  }
+  total.pong[total.npong++] = ms;
+  period.npong++;
+}
+
+static void handle_line(struct client *c, char *line) {
+  char *cmd, *arg, *trailing;
+  unsigned seq;
+  double t = now_ms();
+
+  total.lines_in++;
+  period.lines_in++;
+  if (*line == ':')
+    line += strcspn(line, " ");
+  line += strspn(line, " ");
+  if ((trailing = strstr(line, " :"))) {
+    *trailing = '\0';
+    trailing += 2;
+  }
+  cmd = strtok(line, " ");
+  arg = strtok(NULL, " ");
+  if (!cmd)
+    return;
+  if (!arg)
+    arg = trailing ? trailing : "";
+
+  if (!strcasecmp(cmd, "PONG")) {
+    /* urgent lines jump ircl's queue, so they don't count for pacing */
+    if (c->ping_out && sscanf(arg, "mock%u", &seq) == 1 &&
+        seq == c->ping_seq) {
+      pong_sample(t - c->ping_sent);
+      c->ping_out = false;
+    }
+    return;
+  }
+  pace_line(c, t);
+  if (!strcasecmp(cmd, "NICK")) {
+    snprintf(c->nick, sizeof c->nick, "%s", arg);
+    if (c->has_user && !c->registered && !c->cap_negotiating)
+      register_client(c);
+  } else if (!strcasecmp(cmd, "USER")) {
+    c->has_user = true;
+    if (*c->nick && !c->registered && !c->cap_negotiating)
+      register_client(c);
+  } else if (!strcasecmp(cmd, "CAP")) {
+    handle_cap(c, arg, trailing);
+  } else if (!c->registered) {
+    return; /* PASS, CAP and the like */
+  } else if (!strcasecmp(cmd, "PING")) {
+    sendc(c, ":%s PONG %s :%s", MOCK_HOST, MOCK_HOST, arg);
+  } else if (!strcasecmp(cmd, "JOIN")) {
+    for (arg = strtok(arg, ","); arg; arg = strtok(NULL, ","))
+      join_channel(c, arg);
+  } else if (!strcasecmp(cmd, "PART")) {
+    int ch;
+
+    sendc(c, ":%s!~%s@client.mock PART %s", c->nick, c->nick, arg);
+    if (sscanf(arg, "#load%d", &ch) == 1 && ch >= 0 && ch < nchan)
+      c->joined[ch] = false;
+  } else if (!strcasecmp(cmd, "NAMES")) {
+    int ch = -1;
+
+    if (sscanf(arg, "#load%d", &ch) != 1 || ch < 0 || ch >= nchan)
+      ch = -1;
+    send_names(c, arg, ch);
+  } else if (!strcasecmp(cmd, "WHO")) {
+    send_who(c, arg);
+  } else if (!strcasecmp(cmd, "CHATHISTORY")) {
+    char *target = strtok(NULL, " "), *ref = strtok(NULL, " "),
+         *limit = strtok(NULL, " ");
+
+    if (target && ref && limit)
+      send_history(c, arg, target, ref, atoi(limit));
+    else
+      sendc(c, "FAIL CHATHISTORY NEED_MORE_PARAMS :Missing parameters");
+  } else if (!strcasecmp(cmd, "AWAY")) {
+    if (trailing && *trailing)
+      sendc(c, ":%s 306 %s :You have been marked as being away", MOCK_HOST,
+            c->nick);
+    else
+      sendc(c, ":%s 305 %s :You are no longer marked as being away",
+            MOCK_HOST, c->nick);
+  } else if (!strcasecmp(cmd, "QUIT")) {
+    sendc(c, "ERROR :Closing Link: %s (Quit)", c->nick);
+    c->closing = "quit";
+  }
+  /* PRIVMSG, NOTICE, MODE and the rest go nowhere */
+}
+
+static void drop_client(struct client *c) {
+  LIST_REMOVE(c, link);
+  if (c->ssl) {
+    SSL_shutdown(c->ssl);
+    SSL_free(c->ssl);
+  }
+  close(c->fd);
+  free(c->out);
+  free(c->joined);
+  free(c);
+  nclients--;
+}
+
+static void accept_client(int lfd) {
+  struct client *c;
+  int fd, rcvbuf = SLOW_RCVBUF;
+
+  if ((fd = accept(lfd, NULL, NULL)) == -1)
+    return;
+  if (nclients == MAX_CLIENTS) {
+    close(fd);
+    return;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  if (read_rate > 0) /* back-pressure reaches the client within a few KB */
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+  if (!(c = calloc(1, sizeof *c)) || !(c->joined = calloc(nchan, sizeof(bool))))
+    eprint("mockd: calloc:");
+  c->fd = fd;
+  c->connected = now_ms();
+  c->read_budget = read_rate;
+  if (ssl_ctx) {
+    c->ssl = SSL_new(ssl_ctx);
+    SSL_set_fd(c->ssl, fd);
+    SSL_set_accept_state(c->ssl);
+    c->handshake = true;
+  }
+  LIST_INSERT_HEAD(&clients, c, link);
+  nclients++;
+  total.accepted++;
+}
+
+/* false once the client is gone */
+static bool client_handshake(struct client *c) {
+  int r = SSL_do_handshake(c->ssl);
+
+  if (r == 1) {
+    c->handshake = false;
+    return true;
+  }
+  r = SSL_get_error(c->ssl, r);
+  return r == SSL_ERROR_WANT_READ || r == SSL_ERROR_WANT_WRITE;
+}
+
+static bool client_read(struct client *c) {
+  size_t want;
+  ssize_t n;
+  char *line, *end;
+
+  do {
+    want = sizeof c->in - c->inlen;
+    if (read_rate > 0 && want > c->read_budget)
+      want = c->read_budget;
+    if (want == 0)
+      return true;
+    if (c->ssl) {
+      n = SSL_read(c->ssl, c->in + c->inlen, want);
+      if (n <= 0) {
+        int err = SSL_get_error(c->ssl, n);
+
+        return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE;
+      }
+    } else if ((n = read(c->fd, c->in + c->inlen, want)) <= 0) {
+      return n < 0 && (errno == EAGAIN || errno == EINTR);
+    }
+    c->inlen += n;
+    if (read_rate > 0)
+      c->read_budget -= n;
+
+    line = c->in;
+    while ((end = memchr(line, '\n', c->in + c->inlen - line))) {
+      *end = '\0';
+      if (end > line && end[-1] == '\r')
+        end[-1] = '\0';
+      handle_line(c, line);
+      line = end + 1;
+    }
+    c->inlen -= line - c->in;
+    memmove(c->in, line, c->inlen);
+    if (c->inlen == sizeof c->in)
+      c->inlen = 0; /* no line is this long; drop it */
+  } while (c->ssl && SSL_pending(c->ssl) > 0);
+  return true;
+}
+
+static bool client_write(struct client *c) {
+  ssize_t n;
+
+  while (c->outlen > 0) {
+    if (c->ssl) {
+      n = SSL_write(c->ssl, c->out, c->outlen);
+      if (n <= 0) {
+        int err = SSL_get_error(c->ssl, n);
+
+        return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE;
+      }
+    } else if ((n = write(c->fd, c->out, c->outlen)) == -1) {
+      return errno == EAGAIN || errno == EINTR;
+    }
+    c->outlen -= n;
+    memmove(c->out, c->out + n, c->outlen);
+  }
+  return true;
+}
+
+static int random_present(int ch) {
+  int tries, u;
+
+  for (tries = 0; tries < 8; tries++) {
+    u = ch * nusers + random() % nusers;
+    if (present[u])
+      return u;
+  }
+  return -1;
+}
+
+static void chatter_line(int ch) {
+  struct client *c;
+  int u = random_present(ch), r = random() % 100;
+  const char *text = chatter[random() % (sizeof chatter / sizeof *chatter)];
+
+  if (u < 0)
+    return;
+  if (r < 5)
+    broadcast(ch, ":%s!~u@host%d.mock PRIVMSG #load%d :\1ACTION %s\1",
+              user_nick(u), u, ch, text);
+  else if (r < 7 && (c = LIST_FIRST(&clients)) && *c->nick)
+    broadcast(ch, ":%s!~u@host%d.mock PRIVMSG #load%d :%s: %s",
+              user_nick(u), u, ch, c->nick, text);
+  else
+    broadcast(ch, ":%s!~u@host%d.mock PRIVMSG #load%d :%s", user_nick(u), u,
+              ch, text);
+}
+
+static void churn_line() {
+  int u = random() % (nchan * nusers), ch = u / nusers;
+
+  if (split_end)
+    return; /* don't muddle the split */
+  present[u] = !present[u];
+  if (present[u])
+    broadcast(ch, ":%s!~u@host%d.mock JOIN #load%d", user_nick(u), u, ch);
+  else
+    broadcast(ch, ":%s!~u@host%d.mock PART #load%d :bye", user_nick(u), u,
+              ch);
+}
+
+/* half the users drop off with a split QUIT, and come back SPLIT_MS later */
+static void netsplit(double t) {
+  int u;
+  bool back = split_end != 0;
+
+  for (u = 1; u < nchan * nusers; u += 2) {
+    if (back == present[u])
+      continue;
+    present[u] = back;
+    if (back)
+      broadcast(u / nusers, ":%s!~u@host%d.mock JOIN #load%d", user_nick(u), u,
+                u / nusers);
+    else
+      broadcast(u / nusers, ":%s!~u@host%d.mock QUIT :%s hub.mock",
+                user_nick(u), u, MOCK_HOST);
+  }
+  split_end = back ? 0 : t + SPLIT_MS;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+static double percentile(double *v, size_t n, int p) {
+  return n ? v[n * p / 100 < n ? n * p / 100 : n - 1] : 0;
+}
+
+static void report(bool final, double secs) {
+  size_t n = final ? total.npong : period.npong;
+  double *pong = total.pong + (total.npong - n); /* this period's, or all */
+
+  if (n)
+    qsort(pong, n, sizeof(double), cmp_double);
+  if (!final) {
+    fprintf(stderr,
+            "mockd: %d clients, out %lu lines %lu KB, in %lu lines, "
+            "pong p50 %.2f max %.2f ms\n",
+            nclients, period.lines_out, period.bytes_out / 1024,
+            period.lines_in, percentile(pong, n, 50), n ? pong[n - 1] : 0);
+    return;
+  }
+  fprintf(stderr,
+          "mockd: %.1f s, %lu connections (%lu dropped for SendQ, %lu "
+          "killed)\n"
+          "  out  %lu lines, %.0f lines/s, %.0f KB/s\n"
+          "  in   %lu lines, at most %lu per %d ms, shortest gap %.2f ms\n"
+          "  pong %zu samples, p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+          secs / 1e3, total.accepted, total.dropped, total.killed,
+          total.lines_out, total.lines_out / (secs / 1e3),
+          total.bytes_out / 1024 / (secs / 1e3), total.lines_in,
+          total.max_window, PACE_WINDOW_MS, total.min_gap, n,
+          percentile(pong, n, 50), percentile(pong, n, 99),
+          n ? pong[n - 1] : 0);
+}
+
+int main(int argc, char *argv[]) {
+  struct pollfd pfd[MAX_LISTEN + MAX_CLIENTS];
+  struct client *c, *next;
+  struct sigaction sa;
+  const char *cert_file = NULL;
+  double start, t, last_tick, last_report, next_split = 0, due_msg = 0,
+                                               due_churn = 0, dt;
+  int i, n, opt, duration = 0;
+  bool use_ssl = false;
+
+  for (i = 1; i < argc; i++) {
+    opt = argv[i][0] == '-' && argv[i][1] && !argv[i][2] ? argv[i][1] : -1;
+    if (opt != 's' && opt != 'q' && i + 1 == argc)
+      opt = -1; /* every other flag takes a value */
+    switch (opt) {
+    case 'p':
+      port = argv[++i];
+      break;
+    case 's':
+      use_ssl = true;
+      break;
+    case 'q':
+      quiet = true;
+      break;
+    case 'C':
+      cert_file = argv[++i];
+      break;
+    case 'c':
+      nchan = atoi(argv[++i]);
+      break;
+    case 'u':
+      nusers = atoi(argv[++i]);
+      break;
+    case 'r':
+      msg_rate = atof(argv[++i]);
+      break;
+    case 'j':
+      churn_rate = atof(argv[++i]);
+      break;
+    case 'x':
+      split_secs = atoi(argv[++i]);
+      break;
+    case 'w':
+      extra_names = atoi(argv[++i]);
+      break;
+    case 'b':
+      read_rate = atof(argv[++i]);
+      break;
+    case 'k':
+      kill_secs = atoi(argv[++i]);
+      break;
+    case 'i':
+      ping_ms = atoi(argv[++i]);
+      break;
+    case 't':
+      duration = atoi(argv[++i]);
+      break;
+    default:
+      eprint("usage: mockd [-p port] [-s] [-C cert file] [-c channels] "
+             "[-u users] [-r msgs/s] [-j churn/s] [-x split secs] "
+             "[-w extra names] [-b read bytes/s] [-k kill secs] "
+             "[-i ping ms] [-t secs] [-q]\n");
+    }
+  }
+  if (nchan < 0 || nusers < 1 || ping_ms < 1 || extra_names < 0)
+    eprint("mockd: channels, users, ping interval and padding are counts\n");
+  if (!(present = malloc(nchan * nusers * sizeof(bool) + 1)) ||
+      !(history = calloc(nchan + 1, sizeof *history)))
+    eprint("mockd: malloc:");
+  memset(present, true, nchan * nusers * sizeof(bool));
+  if (use_ssl)
+    initialize_tls(cert_file);
+  listen_on(port ? port : use_ssl ? "6697" : "6667");
+  srandom(time(NULL) ^ getpid());
+
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = handle_stop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  start = last_tick = last_report = now_ms();
+  if (split_secs > 0)
+    next_split = start + split_secs * 1e3;
+  while (!stop) {
+    n = 0;
+    for (i = 0; i < nlisteners; i++)
+      pfd[n++] = (struct pollfd){.fd = listeners[i], .events = POLLIN};
+    LIST_FOREACH(c, &clients, link) {
+      pfd[n] = (struct pollfd){.fd = c->fd};
+      if (read_rate == 0 || c->read_budget >= 1)
+        pfd[n].events |= POLLIN;
+      if (c->outlen)
+        pfd[n].events |= POLLOUT;
+      n++;
+    }
+    if (poll(pfd, n, TICK_MS) == -1 && errno != EINTR)
+      eprint("mockd: poll:");
+    t = now_ms();
+
+    /* clients are in pfd in list order, after the listeners */
+    i = nlisteners;
+    for (c = LIST_FIRST(&clients); c; c = next, i++) {
+      bool ok = true;
+
+      next = LIST_NEXT(c, link);
+      if (pfd[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+        ok = !(pfd[i].revents & (POLLERR | POLLNVAL));
+      if (ok && c->handshake)
+        ok = client_handshake(c);
+      if (ok && !c->handshake && (pfd[i].revents & (POLLIN | POLLHUP)))
+        ok = client_read(c);
+      if (ok && !c->handshake && c->outlen)
+        ok = client_write(c);
+      if (!ok || (c->closing && c->outlen == 0)) {
+        if (!quiet)
+          fprintf(stderr, "mockd: client %s gone (%s)\n",
+                  *c->nick ? c->nick : "-", ok ? c->closing : "disconnected");
+        drop_client(c);
+      }
+    }
+    for (i = 0; i < nlisteners; i++) {
+      if (pfd[i].revents & POLLIN)
+        accept_client(listeners[i]);
+    }
+
+    /* traffic for the slice since the last tick */
+    if ((dt = t - last_tick) < TICK_MS)
+      continue;
+    last_tick = t;
+    LIST_FOREACH(c, &clients, link) {
+      if (read_rate > 0 && (c->read_budget += read_rate * dt / 1e3) > read_rate)
+        c->read_budget = read_rate;
+      if (!c->registered || c->closing)
+        continue;
+      if (kill_secs > 0 && t - c->connected > kill_secs * 1e3) {
+        sendc(c, "ERROR :Closing Link: %s (mock restart)", c->nick);
+        c->closing = "killed";
+        total.killed++;
+      } else if (!c->ping_out && t - c->ping_sent >= ping_ms) {
+        c->ping_sent = t;
+        c->ping_out = true;
+        sendc(c, "PING :mock%u", ++c->ping_seq);
+      }
+    }
+    if (nchan > 0) {
+      for (due_msg += msg_rate * dt / 1e3; due_msg >= 1; due_msg--)
+        chatter_line(random() % nchan);
+      for (due_churn += churn_rate * dt / 1e3; due_churn >= 1; due_churn--)
+        churn_line();
+      if ((next_split && t >= next_split) || (split_end && t >= split_end)) {
+        netsplit(t);
+        if (next_split && t >= next_split)
+          next_split = t + split_secs * 1e3;
+      }
+    }
+    if (t - last_report >= 1000) {
+      if (!quiet)
+        report(false, t - last_report);
+      memset(&period, 0, sizeof period);
+      last_report = t;
+    }
+    if (duration > 0 && t - start >= duration * 1e3)
+      break;
+  }
+  report(true, now_ms() - start);
+  return 0;
+}
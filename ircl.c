@@ -6,19 +6,63 @@ static char *password = NULL;
 static char bufout[4096];
 static char default_channel[256];
 static char default_nick[MAX_NICK_LENGTH];
-static FILE *srv = NULL;
-static LIST_HEAD(nick_list_head, nick_entry)
-    nick_list_head = LIST_HEAD_INITIALIZER(nick_list_head);
-struct nick_entry {
-  LIST_ENTRY(nick_entry) entries;
-  char *nick;
-};
+static int srv = -1;
+static struct nick_registry nicks = {.capacity = MAX_NICKS};
+static struct channel_table channels;
+static struct ircv3 ircv3;
+static struct listing who_list = {.what = "WHO"};
+static struct listing names_list = {.what = "NAMES", .quiet_default = true};
+static struct member_list free_members = LIST_HEAD_INITIALIZER(free_members);
+static unsigned char casemap[256];
+static struct user_file users;
+static struct completion_filter cfilter;
 static int is_away = 0;
-static int previous_prompt_len = 0;
-static const char *active_nicks[ACTIVE_NICKS_QUEUE_SIZE];
+static char active_nicks[ACTIVE_NICKS_QUEUE_SIZE][NICK_NAME_MAX];
 static const char *log_file_path = NULL;
 static bool use_ssl = false;
 static SSL *ssl = NULL;
+static struct recv_buf rbuf;
+static struct send_queue sendq = {.budget_ms = FLOOD_BURST * FLOOD_INTERVAL_MS};
+static struct log_writer logw = {.fd = -1, .sync = LOG_SYNC_NEVER};
+static volatile sig_atomic_t log_reopen_pending = 0;
+static volatile sig_atomic_t resize_pending = 0;
+static struct render_state render;
+static struct arena event_arena;
+static struct matcher hl;
+static char keywords_path[PATH_MAX];
+static struct ev_timer watch_timer = {.func = watch_check};
+#ifdef __linux__
+static struct ev_timer users_settle_timer = {.func = users_reload};
+#endif
+static bool watch_inotify = false; /* else watch_timer stats the files */
+static struct scrollback_store scrollbacks = {.lines = SB_LINES,
+                                              .bytes = SB_BYTES};
+static int signal_pipe[2] = {-1, -1};
+static struct event_loop loop;
+static struct ev_timer log_timer = {.func = log_flush};
+static struct ev_timer ping_timer = {.func = keepalive};
+static struct ev_timer pacer_timer = {.func = send_flush};
+static struct ev_timer dial_timer = {.func = dial_next};
+static struct ev_timer dial_deadline = {.func = dial_failed};
+static struct dialer dialer;
+static bool verbose = false;
+static enum conn_state conn = CONN_OFFLINE;
+static int reconnects = 0; /* failed attempts since the last 001 */
+static struct ev_timer reconnect_timer = {.func = login};
+static struct timespec handshake_started;
+static SSL_CTX *ssl_ctx = NULL;
+static SSL_SESSION *tls_session = NULL;
+static char tls_session_path[PATH_MAX];
+static struct timespec trespond, last_ping;
+static bool pinged = false; /* sent a PING since we last heard anything */
+static struct stats stats = {.lag_ms = -1};
+static struct ev_timer stats_timer = {.func = stats_tick};
+static const char *stat_names[ST_COUNT] = {
+    [ST_PARSESRV] = "parsesrv", [ST_POUT] = "pout",
+    [ST_LOGMSG] = "logmsg",     [ST_SOUT] = "sout",
+    [ST_SSL_READ] = "ssl_read", [ST_SSL_WRITE] = "ssl_write",
+    [ST_RENDER] = "render",     [ST_RELOAD] = "reload",
+};
 
 static void eprint(const char *fmt, ...) {
   va_list ap;
@@ -43,91 +87,370 @@ static void eprint_reconnect(const char *fmt, ...) {
   if (fmt[0] && fmt[strlen(fmt) - 1] == ':')
     fprintf(stderr, " %s\n", strerror(errno));
   logmsg(bufout, len);
-  sleep(1);
-  pout("ircl", "Reconnecting to %s:%s", host, port);
-  remove_all_nicks();
-  remove_all_channels();
-  login();
+  log_flush();
+  disconnect();
+}
+
+/* drop the connection, keeping channels for the rejoin, and schedule the
+ * next attempt with jittered exponential backoff */
+static void disconnect() {
+  struct irc_channel *chan;
+  long delay;
+
+  dial_abort();
+  dialer.gen++; /* ignore a lookup still in flight */
+  if (ssl != NULL) {
+    /* the link is gone, not the session: stop SSL_free() from marking it
+     * unresumable */
+    SSL_set_shutdown(ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    SSL_free(ssl);
+    ssl = NULL;
+  }
+  if (srv != -1) {
+    ev_io_del(srv);
+    close(srv);
+    srv = -1;
+  }
+  ev_timer_cancel(&ping_timer);
+  ev_timer_cancel(&pacer_timer);
+  sendq.count = sendq.off = 0;
+  sendq.retry = false;
+  TAILQ_FOREACH(chan, &channels.order, joined)
+    clear_members(chan);
+  listing_reset(&who_list);
+  listing_reset(&names_list);
+  ircv3.caps = 0;
+  ircv3.nbatches = 0;
+  render.hold = 0;
+  conn = CONN_OFFLINE;
+
+  delay = RECONNECT_MIN_MS << (reconnects < 16 ? reconnects : 16);
+  if (delay > RECONNECT_MAX_MS)
+    delay = RECONNECT_MAX_MS;
+  delay = delay / 2 + random() % (delay / 2 + 1);
+  reconnects++;
+  pout("ircl", "Reconnecting to %s:%s in %ld.%ld s (attempt %d)", host, port,
+       delay / 1000, delay % 1000 / 100, reconnects);
+  ev_timer_arm(&reconnect_timer, delay);
+}
+
+#ifdef __linux__
+static size_t strlcpy(char *to, const char *from, int l) {
+  return snprintf(to, l, "%s", from);
+}
+#endif
+
+/* ms since the current connection attempt began */
+static long dial_elapsed() { return ms_since(&dialer.started); }
+
+static const char *dial_addr(const struct dial_attempt *a) {
+  static char buf[INET6_ADDRSTRLEN + 16];
+  char h[INET6_ADDRSTRLEN], p[16];
+
+  if (getnameinfo((struct sockaddr *)&a->addr, a->addrlen, h, sizeof h, p,
+                  sizeof p, NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+    return "?";
+  snprintf(buf, sizeof buf, a->addr.ss_family == AF_INET6 ? "[%s]:%s" : "%s:%s",
+           h, p);
+  return buf;
 }
 
-static int dial(char *host, char *port) {
-  static struct addrinfo hints;
-  int srv;
-  struct addrinfo *res, *r;
+/* runs on its own thread so a slow resolver can't freeze the terminal */
+static void *resolve(void *arg) {
+  struct dns_query *q = arg;
+  struct dns_answer a = {.gen = q->gen};
+  struct addrinfo hints;
 
   memset(&hints, 0, sizeof hints);
   hints.ai_family = AF_UNSPEC;
   hints.ai_socktype = SOCK_STREAM;
-  if (getaddrinfo(host, port, &hints, &res) != 0)
-    eprint("error: cannot resolve hostname '%s':", host);
-  for (r = res; r; r = r->ai_next) {
-    if ((srv = socket(r->ai_family, r->ai_socktype, r->ai_protocol)) == -1)
+  if ((a.error = getaddrinfo(q->host, q->port, &hints, &a.res)) != 0)
+    a.res = NULL;
+  if (write(q->fd, &a, sizeof a) != sizeof a && a.res)
+    freeaddrinfo(a.res);
+  free(q);
+  return NULL;
+}
+
+/* close every attempt still in flight */
+static void dial_abort() {
+  int i;
+
+  for (i = 0; i < dialer.naddrs; i++) {
+    if (dialer.addrs[i].fd != -1) {
+      ev_io_del(dialer.addrs[i].fd);
+      close(dialer.addrs[i].fd);
+      dialer.addrs[i].fd = -1;
+    }
+  }
+  dialer.naddrs = dialer.next = dialer.pending = 0;
+  ev_timer_cancel(&dial_timer);
+  ev_timer_cancel(&dial_deadline);
+}
+
+/* start resolving host; login_connected() gets the first socket to connect */
+static void dial(const char *host, const char *port) {
+  struct dns_query *q;
+  pthread_t tid;
+
+  dial_abort();
+  dialer.gen++; /* forget any lookup still running */
+  clock_gettime(CLOCK_MONOTONIC, &dialer.started);
+  if (!(q = malloc(sizeof *q)))
+    eprint("ircl: malloc:");
+  q->gen = dialer.gen;
+  q->fd = dialer.dns_pipe[1];
+  strlcpy(q->host, host, sizeof q->host);
+  strlcpy(q->port, port, sizeof q->port);
+  if (pthread_create(&tid, NULL, resolve, q) != 0)
+    eprint("ircl: unable to start resolver thread\n");
+  pthread_detach(tid);
+  ev_timer_arm(&dial_deadline, DIAL_TIMEOUT_SECS * 1000);
+}
+
+static void dial_failed() {
+  dial_abort();
+  eprint_reconnect("ircl: cannot connect to host '%s'\n", host);
+}
+
+/* Start the next address. Called when the stagger delay runs out and as soon
+ * as an attempt fails, so a black-holed address costs DIAL_STAGGER_MS. */
+static void dial_next() {
+  struct dial_attempt *a;
+  int fd;
+
+  while (dialer.next < dialer.naddrs) {
+    a = &dialer.addrs[dialer.next++];
+    if ((fd = socket(a->addr.ss_family, SOCK_STREAM, 0)) == -1)
       continue;
-    if (connect(srv, r->ai_addr, r->ai_addrlen) == 0)
-      break;
-    close(srv);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    a->started_ms = dial_elapsed();
+    if (connect(fd, (struct sockaddr *)&a->addr, a->addrlen) == 0 ||
+        errno == EINPROGRESS) {
+      if (verbose)
+        pout("ircl", "Trying %s (+%ld ms)", dial_addr(a), a->started_ms);
+      a->fd = fd;
+      dialer.pending++;
+      ev_io_add(fd, EV_WRITE, dial_ready);
+      if (dialer.next < dialer.naddrs)
+        ev_timer_arm(&dial_timer, DIAL_STAGGER_MS);
+      return;
+    }
+    if (verbose)
+      pout("ircl", "Connecting to %s failed: %s", dial_addr(a),
+           strerror(errno));
+    close(fd);
   }
-  freeaddrinfo(res);
-  if (!r)
-    eprint("error: cannot connect to host '%s'\n", host);
-  return srv;
+  if (dialer.pending == 0)
+    dial_failed();
 }
 
-static void ssl_connect(const int sock, const char *host) {
-  SSL_CTX *ctx;
-  X509 *x509;
-  const SSL_METHOD *method;
-  int result = 0;
+/* an attempt finished: either it lost, or every other attempt does */
+static void dial_ready(int fd, int events) {
+  struct dial_attempt *a = NULL;
+  socklen_t len = sizeof(int);
+  int i, err = 0;
+
+  UNUSED(events);
+  for (i = 0; i < dialer.naddrs; i++) {
+    if (dialer.addrs[i].fd == fd)
+      a = &dialer.addrs[i];
+  }
+  if (!a)
+    return;
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+    err = errno;
+  ev_io_del(fd);
+  a->fd = -1;
+  dialer.pending--;
+  if (err) {
+    if (verbose)
+      pout("ircl", "Connecting to %s failed after %ld ms: %s", dial_addr(a),
+           dial_elapsed() - a->started_ms, strerror(err));
+    close(fd);
+    ev_timer_cancel(&dial_timer);
+    dial_next();
+    return;
+  }
+  if (verbose)
+    pout("ircl", "Connected to %s in %ld ms (%ld ms since lookup)",
+         dial_addr(a), dial_elapsed() - a->started_ms, dial_elapsed());
+  dial_abort();
+  login_connected(fd);
+}
+
+/* getaddrinfo() finished; race the addresses, alternating families starting
+ * with the preferred one (RFC 8305 section 4) */
+static void dns_ready(int fd, int events) {
+  struct dns_answer ans;
+  struct addrinfo *r, *fam[2][DIAL_MAX_ADDRS];
+  int i, f, n, nfam[2] = {0, 0};
+
+  UNUSED(events);
+  while (read(fd, &ans, sizeof ans) == sizeof ans) {
+    if (ans.gen != dialer.gen) {
+      if (ans.res)
+        freeaddrinfo(ans.res);
+      continue;
+    }
+    if (ans.error) {
+      dial_abort();
+      eprint_reconnect("ircl: cannot resolve hostname '%s': %s\n", host,
+                       gai_strerror(ans.error));
+      continue;
+    }
+    nfam[0] = nfam[1] = 0;
+    /* split by family, keeping the resolver's order within each */
+    for (r = ans.res; r; r = r->ai_next) {
+      i = r->ai_family != ans.res->ai_family;
+      if (nfam[i] < DIAL_MAX_ADDRS)
+        fam[i][nfam[i]++] = r;
+    }
+    for (n = 0, i = 0; n < DIAL_MAX_ADDRS && i < MAX(nfam[0], nfam[1]); i++) {
+      for (f = 0; f < 2 && n < DIAL_MAX_ADDRS; f++) {
+        if (i >= nfam[f])
+          continue;
+        memcpy(&dialer.addrs[n].addr, fam[f][i]->ai_addr, fam[f][i]->ai_addrlen);
+        dialer.addrs[n].addrlen = fam[f][i]->ai_addrlen;
+        dialer.addrs[n].fd = -1;
+        n++;
+      }
+    }
+    dialer.naddrs = n;
+    if (verbose)
+      pout("ircl", "Resolved %s to %d address%s in %ld ms", host, n,
+           n == 1 ? "" : "es", dial_elapsed());
+    freeaddrinfo(ans.res);
+    dial_next();
+  }
+}
+
+/* keep the newest session (a TLS 1.3 ticket arrives after the handshake)
+ * in memory and on disk for the next connect. The file is replaced whole,
+ * so a failed write never leaves a broken session to resume. */
+static int tls_session_new(SSL *s, SSL_SESSION *sess) {
+  unsigned char *der = NULL, *p;
+  char tmp[PATH_MAX + 16];
+  int fd, len;
+  bool ok;
+
+  UNUSED(s);
+  if (tls_session)
+    SSL_SESSION_free(tls_session);
+  tls_session = sess; /* keep the reference we were handed */
+  if ((len = i2d_SSL_SESSION(sess, NULL)) <= 0 || !(der = malloc(len)))
+    return 1;
+  p = der;
+  i2d_SSL_SESSION(sess, &p);
+  snprintf(tmp, sizeof tmp, "%s.tmp", tls_session_path);
+  unlink(tmp); /* a leftover would keep its own permissions */
+  fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  ok = fd != -1 && write(fd, der, len) == len;
+  if (fd != -1)
+    close(fd);
+  if (!ok || rename(tmp, tls_session_path) == -1) {
+    fprintf(stderr, "ERROR: Unable to save TLS session to %s\n",
+            tls_session_path);
+    unlink(tmp);
+  }
+  free(der);
+  return 1;
+}
+
+static void tls_session_load() {
+  unsigned char der[TLS_SESSION_MAX];
+  const unsigned char *p = der;
+  int fd, len;
+
+  if ((fd = open(tls_session_path, O_RDONLY | O_CLOEXEC)) == -1)
+    return;
+  len = read(fd, der, sizeof der);
+  close(fd);
+  if (len > 0)
+    tls_session = d2i_SSL_SESSION(NULL, &p, len);
+}
+
+/* build the context (and load the CA bundle) once for every connect */
+static void initialize_ssl() {
+  const char *home = getenv("HOME");
 
   SSL_library_init();
   SSL_load_error_strings();
-  method = SSLv23_client_method();
-  ctx = SSL_CTX_new(method);
-  if (ctx == NULL)
+  ssl_ctx = SSL_CTX_new(SSLv23_client_method());
+  if (ssl_ctx == NULL)
     eprint("Unable to initialize SSL context\n");
-  SSL_CTX_set_default_verify_paths(ctx);
-  SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2);
-  SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
-  ssl = SSL_new(ctx);
+  SSL_CTX_set_default_verify_paths(ssl_ctx);
+  SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_SSLv2);
+  SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_PEER, NULL);
+  /* the client cache only calls us back; we decide what to offer */
+  SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_CLIENT |
+                                              SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ssl_ctx, tls_session_new);
+  snprintf(tls_session_path, sizeof tls_session_path, "%s/.irclsess-%s-%s",
+           home ? home : "/var/tmp", host, port);
+  tls_session_load();
+}
+
+static void ssl_connect(const int sock, const char *host) {
+  ssl = SSL_new(ssl_ctx);
   if (ssl == NULL)
     eprint("Unable to initialize SSL struct\n");
   SSL_set_fd(ssl, sock);
+  SSL_set_tlsext_host_name(ssl, host);
+  if (tls_session && SSL_SESSION_is_resumable(tls_session))
+    SSL_set_session(ssl, tls_session);
+
+  /* send_flush() may retry a write from a refilled staging buffer */
+  SSL_set_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                        SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  clock_gettime(CLOCK_MONOTONIC, &handshake_started);
+  conn = CONN_HANDSHAKE;
+  ssl_handshake();
+}
+
+/* drive the non-blocking handshake; srv_ready() calls back until it's done */
+static void ssl_handshake() {
+  X509 *x509;
+  struct timespec t1;
+  int result;
 
-  if (1 != SSL_connect(ssl)) {
-    eprint("Unable to connect over SSL (err=%d)\n", SSL_get_error(ssl, result));
+  if ((result = SSL_connect(ssl)) != 1) {
+    switch ((result = SSL_get_error(ssl, result))) {
+    case SSL_ERROR_WANT_READ:
+      ev_io_mod(srv, EV_READ);
+      return;
+    case SSL_ERROR_WANT_WRITE:
+      ev_io_mod(srv, EV_READ | EV_WRITE);
+      return;
+    default:
+      eprint_reconnect("Unable to connect over SSL (err=%d)\n", result);
+      return;
+    }
   }
+  ev_io_mod(srv, EV_READ);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  if (verbose)
+    pout("ircl", "TLS handshake (%s) took %ld ms",
+         SSL_session_reused(ssl) ? "session resumed" : "full",
+         (t1.tv_sec - handshake_started.tv_sec) * 1000 +
+             (t1.tv_nsec - handshake_started.tv_nsec) / 1000000);
 
   if (NULL == (x509 = SSL_get_peer_certificate(ssl))) {
-    eprint("Unable to get peer cert (err=%d)\n", SSL_get_error(ssl, result));
+    eprint_reconnect("Unable to get peer cert\n");
+    return;
   }
 
-  if (1 != X509_check_host(x509, host, strlen(host), 0, NULL)) {
+  result = X509_check_host(x509, host, strlen(host), 0, NULL);
+  X509_free(x509);
+  if (1 != result) {
     eprint("Server cert CN failed to match hostname (%s)\n", host);
   }
 
   if (X509_V_OK != (result = SSL_get_verify_result(ssl))) {
     eprint("Unable to verify peer cert (err=%d)\n", result);
   }
-
-  X509_free(x509);
-  SSL_CTX_free(ctx);
-}
-
-#ifdef __linux__
-static size_t strlcpy(char *to, const char *from, int l) {
-  return snprintf(to, l, "%s", from);
-}
-
-#define dirname _dirname
-static char *dirname(const char *path) {
-  static char pbuf[PATH_MAX];
-  if (strlcpy(pbuf, path, sizeof(pbuf)) >= sizeof(pbuf)) {
-    errno = ENAMETOOLONG;
-    return NULL;
-  }
-  return _dirname(pbuf);
+  register_nick();
 }
-#endif
 
 static char *eat(char *s, int (*p)(int), int r) {
   while (*s != '\0' && p(*s) == r)
@@ -143,13 +466,43 @@ static char *skip(char *s, char c) {
   return s;
 }
 
-static void trim(char *s) {
-  char *e;
+/* n bytes that live until arena_reset(), when the current line is done */
+static void *arena_alloc(size_t n) {
+  struct arena_block *b = event_arena.cur, *nb;
 
-  e = s + strlen(s) - 1;
-  while (isspace(*e) && e > s)
-    e--;
-  *(e + 1) = '\0';
+  n = SB_ALIGN(n);
+  while (b && b->used + n > b->size && b->next) {
+    b = b->next;
+    b->used = 0;
+  }
+  if (!b || b->used + n > b->size) {
+    /* only the first lines big enough to need it get here */
+    if (!(nb = malloc(offsetof(struct arena_block, data) +
+                      MAX(n, ARENA_BLOCK))))
+      eprint("ircl: unable to grow arena:");
+    nb->next = NULL;
+    nb->size = MAX(n, ARENA_BLOCK);
+    nb->used = 0;
+    if (b)
+      b->next = nb;
+    else
+      event_arena.first = nb;
+    b = nb;
+  }
+  event_arena.cur = b;
+  b->used += n;
+  return b->data + b->used - n;
+}
+
+static char *arena_strdup(const char *s) {
+  size_t len = strlen(s) + 1;
+
+  return memcpy(arena_alloc(len), s, len);
+}
+
+static void arena_reset() {
+  if ((event_arena.cur = event_arena.first))
+    event_arena.first->used = 0;
 }
 
 static void initialize_logging(const char *log_file) {
@@ -157,8 +510,6 @@ static void initialize_logging(const char *log_file) {
   char *base_path;
   int log_file_path_len = 0;
 
-  SIMPLEQ_INIT(&hist_head); /* initialize history queue */
-
   if (!log_file) {
     base_path = getenv("HOME");
     if (!base_path)
@@ -183,145 +534,753 @@ static void initialize_logging(const char *log_file) {
     }
   }
   printf("Logging to %s\n", log_file_path);
-  if (0 != access(log_file_path, R_OK | W_OK)) {
-    if (errno == ENOENT) {
-      const char *dir_path = dirname(log_file_path);
-      if (dir_path && (0 == access(dir_path, R_OK | W_OK))) {
-        return;
-      }
-    }
+  if (log_open() == -1) {
     eprint("Unable to write to log file %s: %s\n", log_file_path,
            strerror(errno));
   }
 }
 
+static int log_open() {
+  logw.fd = open(log_file_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+  return logw.fd;
+}
+
+/* SIGHUP reopens the log, SIGWINCH redraws: both done from the loop */
+static void handle_signal(int sig) {
+  int saved_errno = errno;
+
+  if (sig == SIGWINCH)
+    resize_pending = 1;
+  else
+    log_reopen_pending = 1;
+  if (write(signal_pipe[1], "", 1) == -1) {
+    /* already a wakeup pending */
+  }
+  errno = saved_errno;
+}
+
+/* write out everything buffered so far, honoring the fsync policy */
+static void log_flush() {
+  size_t off = 0;
+  ssize_t n;
+
+  if (logw.len == 0)
+    return;
+  if (logw.fd == -1)
+    log_open();
+  while (logw.fd != -1 && off < logw.len) {
+    n = write(logw.fd, logw.buf + off, logw.len - off);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "ERROR: Unable to write log file %s: %s\n",
+              log_file_path, strerror(errno));
+      break;
+    }
+    off += n;
+  }
+  if (logw.fd != -1 && logw.sync != LOG_SYNC_NEVER)
+    fsync(logw.fd);
+  logw.len = 0;
+  ev_timer_cancel(&log_timer);
+}
+
+/* SIGHUP: logrotate moved the old file away */
+static void log_reopen() {
+  log_flush();
+  if (logw.fd != -1)
+    close(logw.fd);
+  if (log_open() == -1)
+    fprintf(stderr, "ERROR: Unable to reopen log file %s: %s\n",
+            log_file_path, strerror(errno));
+}
+
 static void logmsg(const char *msg, const int len) {
-  FILE *logf;
-  logf = fopen(log_file_path, "a");
-  fwrite(msg, len, 1, logf);
-  fclose(logf);
+  struct timespec t0;
+
+  stats_start(&t0);
+  if (logw.len + len > sizeof(logw.buf))
+    log_flush();
+  if ((size_t)len > sizeof(logw.buf)) {
+    /* too big to buffer; hand it straight to the kernel */
+    if (logw.fd != -1 && write(logw.fd, msg, len) != len)
+      fprintf(stderr, "ERROR: Unable to write log file %s: %s\n",
+              log_file_path, strerror(errno));
+  } else {
+    if (logw.len == 0)
+      ev_timer_arm(&log_timer, LOG_FLUSH_SECS * 1000);
+    memcpy(logw.buf + logw.len, msg, len);
+    logw.len += len;
+    if (logw.sync == LOG_SYNC_ALWAYS)
+      log_flush();
+  }
+  stats_stop(ST_LOGMSG, &t0);
+}
+
+static void stats_start(struct timespec *t0) {
+  clock_gettime(CLOCK_MONOTONIC, t0);
+}
+
+/* charge the time since t0 to a histogram */
+static void stats_stop(enum stat_timer which, const struct timespec *t0) {
+  struct histogram *h = &stats.timers[which];
+  struct timespec t1;
+  unsigned long long ns, us;
+  int b = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  ns = (long long)(t1.tv_sec - t0->tv_sec) * 1000000000LL +
+       (t1.tv_nsec - t0->tv_nsec);
+  for (us = ns / 1000; us && b < STATS_BUCKETS - 1; us >>= 1)
+    b++;
+  h->count++;
+  h->total_ns += ns;
+  if (ns > h->max_ns)
+    h->max_ns = ns;
+  h->buckets[b]++;
 }
 
-static char *highlight_user(const char *buf) {
-  int buf_len = 0, nick_str_len = 0;
-  char nick_buf[MAX_NICK_LENGTH + 3];
-  char *tmp_buf = NULL;
+/* upper bound, in microseconds, of the bucket holding the pct'th
+ * percentile */
+static unsigned long stats_percentile(const struct histogram *h, int pct) {
+  unsigned long seen = 0, want = (h->count * pct + 99) / 100;
+  int b;
 
-  nick_str_len = snprintf(nick_buf, sizeof nick_buf, "%s: ", default_nick);
+  for (b = 0; b < STATS_BUCKETS - 1; b++) {
+    if ((seen += h->buckets[b]) >= want)
+      break;
+  }
+  return 1UL << b;
+}
+
+static size_t scrollback_lines() {
+  struct scrollback *sb;
+  size_t n = 0;
 
-  if (!strncmp(buf, nick_buf, nick_str_len)) {
-    buf_len = strlen(buf) + strlen(COLOR_PM_INCOMING COLOR_RESET) + 1;
-    tmp_buf = calloc(buf_len, sizeof(char));
-    snprintf(tmp_buf, buf_len, "%s%s%s: %s", COLOR_PM_INCOMING, default_nick,
-             COLOR_RESET, buf + nick_str_len);
+  TAILQ_FOREACH(sb, &scrollbacks.lru, lru)
+    n += sb->count;
+  return n;
+}
+
+/* -S: everything /stats shows, as one JSON object per line */
+static void stats_dump() {
+  const struct histogram *h;
+  int i, b;
+
+  fprintf(stats.dump,
+          "{\"time\":%lld,\"uptime\":%ld,\"bytes_in\":%llu,"
+          "\"bytes_out\":%llu,\"lines_in\":%lu,\"lines_out\":%lu,"
+          "\"lines_dropped\":%lu,\"lines_split\":%lu,\"nicks\":%zu,"
+          "\"scrollback_rings\":%zu,\"scrollback_lines\":%zu,"
+          "\"scrollback_bytes\":%zu,\"render_lines\":%lu,"
+          "\"render_batches\":%lu,\"lag_ms\":%ld,\"users\":%zu,"
+          "\"users_reloads\":%lu,\"users_added\":%lu,"
+          "\"users_removed\":%lu",
+          (long long)time(NULL), ms_since(&stats.started) / 1000,
+          stats.bytes_in, stats.bytes_out, stats.lines_in, stats.lines_out,
+          stats.lines_dropped, rbuf.dropped, nicks.count, scrollbacks.count,
+          scrollback_lines(), scrollbacks.arena, render.lines, render.batches,
+          stats.lag_ms, users.count, users.reloads, users.added,
+          users.removed);
+  for (i = 0; i < ST_COUNT; i++) {
+    h = &stats.timers[i];
+    fprintf(stats.dump,
+            ",\"%s\":{\"count\":%lu,\"total_us\":%llu,\"max_us\":%llu,"
+            "\"buckets\":[",
+            stat_names[i], h->count, h->total_ns / 1000, h->max_ns / 1000);
+    for (b = 0; b < STATS_BUCKETS; b++)
+      fprintf(stats.dump, "%s%lu", b ? "," : "", h->buckets[b]);
+    fprintf(stats.dump, "]}");
   }
-  return tmp_buf;
+  fprintf(stats.dump, "}\n");
+  fflush(stats.dump);
 }
 
-static void pout(const char *channel, char *fmt, ...) {
-  static char timestr[32];
-  static char logbuf[4096];
-  time_t t;
-  va_list ap;
-  int saved_point, save_prompt, len;
-  char *saved_line;
-
-  save_prompt = !RL_ISSTATE(RL_STATE_DONE);
-  if (save_prompt) {
-    saved_point = rl_point;
-    saved_line = rl_copy_text(0, rl_end);
-    rl_save_prompt();
-    rl_replace_line("", 1);
-    rl_clear_message();
+/* every STATS_SECS: time a PING for the lag figure, and dump if asked to */
+static void stats_tick() {
+  if (conn == CONN_ONLINE) {
+    sout_urgent("PING %s", host);
+    clock_gettime(CLOCK_MONOTONIC, &stats.lag_sent);
+    stats.lag_pending = true;
+  }
+  if (stats.dump)
+    stats_dump();
+  ev_timer_arm(&stats_timer, STATS_SECS * 1000);
+}
+
+/* The column text ends at on screen when drawn from col, as readline
+ * draws it: UTF-8 by wcwidth, tabs to the next stop and control
+ * characters as ^X. In a prompt, ANSI escapes and the \001...\002 they
+ * sit in take no room. A wide character that won't fit at the end of a
+ * row starts the next one. */
+static int screen_col(int col, const char *s, size_t n, int cols,
+                      bool prompt) {
+  const char *end = s + n;
+  mbstate_t ps;
+  wchar_t wc;
+  size_t len;
+  int w;
+
+  memset(&ps, 0, sizeof ps);
+  while (s < end) {
+    if (prompt && *s == RL_PROMPT_START_IGNORE) {
+      while (s < end && *s != RL_PROMPT_END_IGNORE)
+        s++;
+      s++;
+      continue;
+    }
+    if (prompt && *s == '\033' && s + 1 < end && s[1] == '[') {
+      for (s += 2; s < end && (*s < 0x40 || *s > 0x7e); s++)
+        ;
+      s++;
+      continue;
+    }
+    if (*s == '\t') {
+      col = (col | 7) + 1;
+      s++;
+      continue;
+    }
+    len = mbrtowc(&wc, s, end - s, &ps);
+    if (len == (size_t)-1 || len == (size_t)-2) {
+      memset(&ps, 0, sizeof ps);
+      len = 1;
+      w = 1;
+    } else {
+      if (len == 0)
+        len = 1;
+      if ((w = wcwidth(wc)) < 0)
+        w = wc < 0x80 ? 2 : 1; /* ^X */
+    }
+    if (w > 1 && cols > 0 && col % cols + w > cols)
+      col += cols - col % cols;
+    col += w;
+    s += len;
+  }
+  return col;
+}
+
+/* Take the prompt and input line off the screen for a batch of output.
+ * Lines then pile up in stdout's buffer until render_flush() puts the
+ * prompt back, so a burst of server lines costs one redraw and one write.
+ * The erase is worked out here rather than asked of readline, which would
+ * write it out at once. */
+static void render_begin() {
+  int rows, cols, col;
+
+  if (render.open)
+    return;
+  render.open = true;
+  render.nlines = 0;
+  clock_gettime(CLOCK_MONOTONIC, &render.opened);
+  render.saved = !RL_ISSTATE(RL_STATE_DONE);
+  if (render.saved) {
+    /* back to the row the prompt starts on, and clear from there down */
+    rl_get_screen_size(&rows, &cols);
+    if (rl_display_prompt)
+      col = screen_col(0, rl_display_prompt, strlen(rl_display_prompt), cols,
+                       true);
+    else
+      col = 0;
+    col = screen_col(col, rl_line_buffer, rl_point, cols, false);
+    rows = cols > 0 ? col / cols : 0;
+    if (rows > 0)
+      fprintf(rl_outstream, "\r\033[%dA\033[J", rows);
+    else
+      fputs("\r\033[J", rl_outstream);
+    rl_on_new_line(); /* readline draws it all again next time */
+  }
+}
+
+/* end the batch, leaving the redraw and the write to whoever redisplays
+ * next: readline does after every key */
+static void render_end() {
+  if (!render.open)
+    return;
+  render.open = false;
+  render.batches++;
+  render.lines += render.nlines;
+}
+
+/* end the batch: redraw the prompt and write everything out */
+static void render_flush() {
+  unsigned long nlines = render.nlines;
+  struct timespec t0;
+
+  if (!render.open)
+    return;
+  stats_start(&t0);
+  render_end();
+  if (render.saved)
     rl_redisplay();
+  fflush(rl_outstream);
+  stats_stop(ST_RENDER, &t0);
+  if (verbose && nlines >= RENDER_REPORT_LINES) {
+    pout("ircl", "Rendered %lu lines in one batch (%lu redraws saved so far)",
+         nlines, render.lines - render.batches);
+    render_flush();
   }
+}
 
-  va_start(ap, fmt);
-  vsnprintf(bufout, sizeof bufout, fmt, ap);
-  va_end(ap);
-  t = time(NULL);
+/* how long the loop may sleep before the open batch must go out: at once,
+ * unless a page of history is still arriving, which gets RENDER_HOLD_MS
+ * from the batch's first line in case its end never comes */
+static long render_wait() {
+  long left;
+
+  if (!render.open || !render.hold)
+    return 0;
+  left = RENDER_HOLD_MS - ms_since(&render.opened);
+  return left > 0 ? left : 0;
+}
+
+/* show and log one formatted line */
+static void pout_line(const char *channel, const char *text, time_t t) {
+  static char timestr[32];
+  static char logbuf[4096];
+  struct timespec t0;
+  int len;
+
+  stats_start(&t0);
+  render_begin();
+  render.nlines++;
 
   strftime(timestr, sizeof timestr, "%R", localtime(&t));
   fprintf(rl_outstream, "%s : %s%s" COLOR_RESET " %s\n", timestr,
-          channel_color(channel), channel, bufout);
+          channel_color(channel), channel, text);
 
   strftime(timestr, sizeof timestr, "%D %T", localtime(&t));
   len = snprintf(logbuf, sizeof(logbuf), "%s : %s %s\n", timestr, channel,
-                 bufout);
+                 text);
   logmsg(logbuf, len);
-  if (!strcmp(channel, default_nick)) {
-    char *recip = parse_recipient(logbuf);
-    if (recip) {
-      add_msg_history(recip, logbuf);
-      free(recip);
+  stats_stop(ST_POUT, &t0);
+
+  /* don't let a long burst keep the prompt off screen, and history only
+   * for as long as render_wait() allows */
+  if (ms_since(&render.opened) >=
+      (render.hold ? RENDER_HOLD_MS : RENDER_FRAME_MS))
+    render_flush();
+}
+
+/* status and server lines: kept in channel's scrollback as shown */
+static void pout(const char *channel, char *fmt, ...) {
+  struct irc_event ev = {.kind = MSG_INFO, .time = time(NULL)};
+  va_list ap;
+
+  va_start(ap, fmt);
+  vsnprintf(bufout, sizeof bufout, fmt, ap);
+  va_end(ap);
+  ev.target = channel;
+  ev.text = bufout;
+  pout_line(channel, bufout, ev.time);
+  if (strcmp(channel, default_nick))
+    sb_append(channel, &ev);
+}
+
+static bool is_word_char(int c) { return isalnum((unsigned char)c) || c == '_'; }
+
+/* Compile our nick and the keyword file (one per line, # comments) into
+ * hl. Runs at startup, when our nick changes and when the file does. */
+static void highlight_build() {
+  struct matcher m = {.ncols = 1, .nstates = 1};
+  unsigned short folded[256] = {0};
+  struct stat st;
+  FILE *f;
+  char **words = NULL, *line = NULL, *w;
+  size_t cap = 0, nwords = 0, wcap = 0, total = 0, len, i;
+  int *fail, *queue, head = 0, tail = 0, r, s, u, col;
+  const unsigned char *p;
+
+  /* note the file even if it can't be read, or every check would
+   * take it for a new one */
+  if (keywords_path[0] && stat(keywords_path, &st) == 0) {
+    m.mtime = st.st_mtime;
+    m.size = st.st_size;
+  }
+  if (m.mtime && (f = fopen(keywords_path, "r"))) {
+    while (getline(&line, &cap, f) != -1) {
+      line[strcspn(line, "\r\n")] = '\0';
+      w = stripwhite(line);
+      if (!*w || *w == '#' || strlen(w) > IRC_LINE_MAX)
+        continue;
+      if (nwords + 1 >= wcap &&
+          !(words = realloc(words, (wcap = wcap ? wcap * 2 : 64) *
+                                       sizeof *words)))
+        eprint("ircl: realloc:");
+      words[nwords++] = strdup(w);
     }
-  } else {
-    add_msg_history(channel, logbuf);
+    fclose(f);
+    free(line);
   }
+  m.nkeywords = nwords;
+  /* an empty pattern would match everywhere: a nick can be empty */
+  if (default_nick[0]) {
+    if (nwords + 1 >= wcap &&
+        !(words = realloc(words, ++wcap * sizeof *words)))
+      eprint("ircl: realloc:");
+    words[nwords++] = strdup(default_nick);
+  }
+  m.npats = nwords;
 
-  if (save_prompt) {
-    rl_restore_prompt();
-    rl_replace_line(saved_line, 0);
-    rl_point = saved_point;
-    rl_redisplay();
-    rl_resize_terminal();
-    free(saved_line);
+  for (i = 0; i < nwords; i++) {
+    for (p = (unsigned char *)words[i]; *p; p++, total++) {
+      if (!folded[casemap[*p]])
+        folded[casemap[*p]] = m.ncols++;
+    }
   }
+  for (i = 0; i < 256; i++)
+    m.cols[i] = folded[casemap[i]];
+  m.delta = calloc((total + 1) * m.ncols, sizeof(int));
+  m.out = malloc((total + 1) * sizeof(int));
+  m.dict = malloc((total + 1) * sizeof(int));
+  m.pats = malloc(nwords * sizeof(struct hl_pattern));
+  fail = malloc((total + 1) * sizeof(int));
+  queue = malloc((total + 1) * sizeof(int));
+  if (!m.delta || !m.out || !m.dict || !m.pats || !fail || !queue)
+    eprint("ircl: unable to build highlighter:");
+  for (i = 0; i <= total; i++)
+    m.out[i] = m.dict[i] = -1;
+
+  /* the trie: state 0 is the root, and no edge leads back to it */
+  for (i = 0; i < nwords; i++) {
+    len = strlen(words[i]);
+    m.pats[i].len = len;
+    m.pats[i].word_start = is_word_char(words[i][0]);
+    m.pats[i].word_end = is_word_char(words[i][len - 1]);
+    for (s = 0, p = (unsigned char *)words[i]; *p; p++) {
+      col = m.cols[*p];
+      if (!m.delta[s * m.ncols + col])
+        m.delta[s * m.ncols + col] = m.nstates++;
+      s = m.delta[s * m.ncols + col];
+    }
+    if (m.out[s] < 0)
+      m.out[s] = i;
+    free(words[i]);
+  }
+  free(words);
+
+  /* breadth first, so a state's failure target has its row complete */
+  fail[0] = 0;
+  queue[tail++] = 0;
+  while (head < tail) {
+    r = queue[head++];
+    for (col = 0; col < m.ncols; col++) {
+      if ((u = m.delta[r * m.ncols + col])) {
+        fail[u] = r ? m.delta[fail[r] * m.ncols + col] : 0;
+        m.dict[u] = m.out[fail[u]] >= 0 ? fail[u] : m.dict[fail[u]];
+        queue[tail++] = u;
+      } else if (r) {
+        m.delta[r * m.ncols + col] = m.delta[fail[r] * m.ncols + col];
+      }
+    }
+  }
+  free(fail);
+  free(queue);
+
+  free(hl.delta);
+  free(hl.out);
+  free(hl.dict);
+  free(hl.pats);
+  hl = m;
 }
 
-static void add_channel(const char *channel) {
-  short i = 0;
+static void keywords_reload() {
+  struct timespec t0;
 
-  for (i = 0; i < MAX_CHANNELS; i++) {
-    if (active_channels[i].name == NULL) {
-      active_channels[i].name = strdup(channel);
-      return;
+  stats_start(&t0);
+  highlight_build();
+  stats_stop(ST_RELOAD, &t0);
+  pout("ircl", "Highlighting %d keywords from %s", hl.nkeywords,
+       keywords_path);
+}
+
+/* rebuild when ~/.irclkeywords appears, changes or goes away */
+static void keywords_check() {
+  struct stat st;
+  bool changed;
+
+  if (stat(keywords_path, &st) == 0)
+    changed = st.st_mtime != hl.mtime || st.st_size != hl.size;
+  else
+    changed = hl.mtime != 0;
+  if (changed)
+    keywords_reload();
+}
+
+static void initialize_highlight() {
+  const char *home = getenv("HOME");
+
+  snprintf(keywords_path, sizeof keywords_path, "%s/.irclkeywords",
+           home ? home : "/tmp");
+  highlight_build();
+}
+
+static void append(char *buf, size_t size, size_t *len, const char *s,
+                   size_t n) {
+  if (n > size - 1 - *len)
+    n = size - 1 - *len;
+  memcpy(buf + *len, s, n);
+  *len += n;
+}
+
+/* Copy text into buf with our nick and every keyword colored, in one pass
+ * of the automaton. A pattern that starts (ends) with a word character
+ * only matches where the text doesn't carry on the word before (after)
+ * it: "bob" is not found in "bobby", but "OPS-" is found in "OPS-123". */
+static int highlight(char *buf, size_t size, const char *text) {
+  struct {
+    size_t start, end;
+  } spans[HL_MAX_SPANS];
+  const struct hl_pattern *pat;
+  size_t i, start, pos = 0, len = 0;
+  int s = 0, t, n = 0, k;
+
+  for (i = 0; hl.delta && text[i]; i++) {
+    s = hl.delta[s * hl.ncols + hl.cols[(unsigned char)text[i]]];
+    for (t = hl.out[s] >= 0 ? s : hl.dict[s]; t >= 0; t = hl.dict[t]) {
+      pat = &hl.pats[hl.out[t]];
+      start = i + 1 - pat->len;
+      if ((pat->word_start && start > 0 && is_word_char(text[start - 1])) ||
+          (pat->word_end && is_word_char(text[i + 1])))
+        continue;
+      /* the longest match ending here; fold in any it overlaps */
+      while (n > 0 && start <= spans[n - 1].end) {
+        if (spans[n - 1].start < start)
+          start = spans[n - 1].start;
+        n--;
+      }
+      if (n < HL_MAX_SPANS) {
+        spans[n].start = start;
+        spans[n].end = i + 1;
+        n++;
+      }
+      break;
     }
   }
-  pout("ircl", "Error: Maximum (%d) channels reached; can't join.",
-       MAX_CHANNELS);
+  for (k = 0; k < n; k++) {
+    append(buf, size, &len, text + pos, spans[k].start - pos);
+    append(buf, size, &len, COLOR_PM_INCOMING, strlen(COLOR_PM_INCOMING));
+    append(buf, size, &len, text + spans[k].start,
+           spans[k].end - spans[k].start);
+    append(buf, size, &len, COLOR_RESET, strlen(COLOR_RESET));
+    pos = spans[k].end;
+  }
+  append(buf, size, &len, text + pos, strlen(text + pos));
+  buf[len] = '\0';
+  return n;
 }
 
-static void remove_channel(const char *channel) {
-  short i = 0;
-  char *name = NULL;
-
-  for (i = 0; i < MAX_CHANNELS; i++) {
-    name = (char *)active_channels[i].name;
-    if (name && !strcmp(name, channel)) {
-      free(name);
-      active_channels[i].name = NULL;
-      return;
-    }
+/* text after a prefix of n bytes, highlighted if it came from someone
+ * else; returns the number of highlights */
+static int format_text(char *buf, size_t size, int n, const char *text,
+                       bool incoming) {
+  if (n < 0 || (size_t)n >= size)
+    return 0;
+  if (incoming)
+    return highlight(buf + n, size - n, text);
+  snprintf(buf + n, size - n, "%s", text);
+  return 0;
+}
+
+/* the display form of an event, as live and in /last; returns the number
+ * of highlights in it */
+static int format_event(char *buf, size_t size, const struct irc_event *ev) {
+  bool incoming = strcmp(ev->source, default_nick) != 0;
+  const char *color = incoming ? COLOR_INCOMING : COLOR_OUTGOING;
+  int n;
+
+  switch (ev->kind) {
+  case MSG_PRIVMSG:
+    n = snprintf(buf, size, "<%s%s" COLOR_RESET "> ", color, ev->source);
+    return format_text(buf, size, n, ev->text, incoming);
+  case MSG_ACTION:
+    n = snprintf(buf, size, "* %s%s" COLOR_RESET " ", color, ev->source);
+    return format_text(buf, size, n, ev->text, incoming);
+  case MSG_NOTICE:
+    n = snprintf(buf, size, "NOTICE > ");
+    return format_text(buf, size, n, ev->text, incoming);
+  case MSG_JOIN:
+    snprintf(buf, size, "> joined %s%s%s", channel_color(ev->target),
+             ev->target, COLOR_RESET);
+    break;
+  case MSG_PART:
+    snprintf(buf, size, "> left %s %s", ev->target, ev->text);
+    break;
+  case MSG_KICK:
+    if (!strcmp(ev->arg, default_nick))
+      snprintf(buf, size, "> kicked you from %s %s", ev->target, ev->text);
+    else
+      snprintf(buf, size, "> kicked %s from %s %s", ev->arg, ev->target,
+               ev->text);
+    break;
+  case MSG_QUIT:
+    snprintf(buf, size, "> left %s", ev->text);
+    break;
+  case MSG_NICK:
+    snprintf(buf, size, "> is now known as " COLOR_CHANNEL "%s" COLOR_RESET,
+             ev->text);
+    break;
+  case MSG_TOPIC:
+    snprintf(buf, size, "%s TOPIC: %s", ev->target, ev->text);
+    break;
+  default:
+    snprintf(buf, size, "%s", ev->text);
+  }
+  return 0;
+}
+
+/* where an event is shown: joins, parts and the like under the nick */
+static const char *event_window(const struct irc_event *ev) {
+  switch (ev->kind) {
+  case MSG_PRIVMSG:
+  case MSG_ACTION:
+  case MSG_INFO:
+    return ev->target;
+  default:
+    return ev->source;
   }
-  fprintf(stderr, "ERROR: Unable to remove channel %s\n", channel);
 }
 
-static void remove_all_channels() {
-  short i = 0;
-  char *name = NULL;
+/* whose scrollback keeps it: private messages go under the other party's
+ * name, channel events under the channel */
+static const char *event_key(const struct irc_event *ev) {
+  switch (ev->kind) {
+  case MSG_PRIVMSG:
+  case MSG_ACTION:
+    return irc_strcasecmp(ev->target, default_nick) ? ev->target : ev->source;
+  case MSG_JOIN:
+  case MSG_PART:
+  case MSG_KICK:
+  case MSG_TOPIC:
+  case MSG_INFO:
+    return ev->target;
+  default:
+    return ev->source;
+  }
+}
 
-  for (i = 0; i < MAX_CHANNELS; i++) {
-    name = (char *)active_channels[i].name;
-    if (name) {
-      free(name);
-      active_channels[i].name = NULL;
+/* hand an event to everything that wants it: completion ranking, then the
+ * screen and transcript, then scrollback */
+static void emit(const struct irc_event *ev) {
+  struct irc_channel *chan;
+  const char *key;
+  int highlights;
+
+  switch (ev->kind) {
+  case MSG_PRIVMSG:
+  case MSG_ACTION:
+    if (strcmp(ev->source, default_nick)) {
+      update_active_nicks(ev->source);
+      insert_nick(ev->source);
+    } else {
+      insert_nick(ev->target); /* whoever we talk to ranks first */
     }
+    break;
+  case MSG_NOTICE:
+    insert_nick(ev->source);
+    break;
+  case MSG_JOIN:
+    insert_nick(ev->source);
+    if (!strcmp(ev->source, default_nick))
+      insert_nick(ev->target); /* channels complete too */
+    break;
+  default:
+    break;
+  }
+  if (ev->muted)
+    return;
+  highlights = format_event(bufout, sizeof bufout, ev);
+  pout_line(event_window(ev), bufout, ev->time);
+  if ((ev->kind == MSG_PRIVMSG || ev->kind == MSG_ACTION ||
+       ev->kind == MSG_NOTICE) &&
+      strcmp(ev->source, default_nick) && (chan = find_channel(ev->target)) &&
+      irc_strcasecmp(chan->name, default_channel)) {
+    chan->unread++;
+    if (highlights)
+      chan->mentions++;
+  }
+  if (strcmp((key = event_key(ev)), default_nick))
+    sb_append(key, ev);
+}
+
+static void initialize_channels() {
+  size_t i;
+
+  channels.nbuckets = CHAN_BUCKETS;
+  if (!(channels.buckets = calloc(channels.nbuckets, sizeof(struct chan_bucket))))
+    eprint("ircl: calloc:");
+  for (i = 0; i < channels.nbuckets; i++)
+    LIST_INIT(&channels.buckets[i]);
+  TAILQ_INIT(&channels.order);
+}
+
+/* double the buckets; entries stay where they are, so pointers to them
+ * (memberships, the completion scope) survive */
+static void grow_channels() {
+  struct irc_channel *chan;
+
+  free(channels.buckets);
+  channels.nbuckets *= 2;
+  if (!(channels.buckets = calloc(channels.nbuckets, sizeof(struct chan_bucket))))
+    eprint("ircl: unable to grow channel table:");
+  TAILQ_FOREACH(chan, &channels.order, joined)
+    LIST_INSERT_HEAD(CHAN_BUCKET(chan->name), chan, hash);
+}
+
+/* a name that doesn't fit is left out rather than cut short: the stored
+ * name would never match the server's again */
+static void add_channel(const char *channel) {
+  struct irc_channel *chan;
+
+  if (strlen(channel) >= sizeof chan->name) {
+    fprintf(stderr, "ERROR: Channel name too long: %s\n", channel);
+    return;
+  }
+  if (!(chan = calloc(1, sizeof *chan)))
+    eprint("ircl: calloc:");
+  strlcpy(chan->name, channel, sizeof chan->name);
+  chan->color = channel_colors[irc_hash(channel) % CHANNEL_COLORS];
+  LIST_INIT(&chan->members);
+  if (++channels.count > channels.nbuckets)
+    grow_channels();
+  LIST_INSERT_HEAD(CHAN_BUCKET(chan->name), chan, hash);
+  TAILQ_INSERT_TAIL(&channels.order, chan, joined);
+}
+
+static void remove_channel(const char *channel) {
+  struct irc_channel *chan;
+
+  if (!(chan = find_channel(channel))) {
+    fprintf(stderr, "ERROR: Unable to remove channel %s\n", channel);
+    return;
+  }
+  clear_members(chan);
+  if (cfilter.scope == chan)
+    cfilter.scope = NULL;
+  LIST_REMOVE(chan, hash);
+  TAILQ_REMOVE(&channels.order, chan, joined);
+  channels.count--;
+  free(chan);
+}
+
+static struct irc_channel *find_channel(const char *channel) {
+  struct irc_channel *chan;
+
+  LIST_FOREACH(chan, CHAN_BUCKET(channel), hash) {
+    if (!irc_strcasecmp(chan->name, channel))
+      return chan;
   }
+  return NULL;
 }
 
 static const char *channel_color(const char *channel) {
-  short i = 0;
+  struct irc_channel *chan;
 
   if (!strcmp(channel, default_nick)) {
     return COLOR_PM_INCOMING;
   }
-  for (i = 0; i < MAX_CHANNELS; i++) {
-    if (active_channels[i].name && !strcmp(active_channels[i].name, channel)) {
-      return active_channels[i].color;
-    }
-  }
-  return active_channels[MAX_CHANNELS - 1].color; /* default */
+  if ((chan = find_channel(channel)))
+    return chan->color;
+  return channel_colors[CHANNEL_COLORS - 1]; /* default */
 }
 
 static void set_default_channel() {
@@ -339,31 +1298,192 @@ static void update_prompt(const char *channel) {
   if (is_away) {
     sep = '*';
   }
-  snprintf(prompt, sizeof(prompt), "%s%c ", channel, sep);
-  previous_prompt_len = strlen(rl_prompt); /* for future redraw */
+  sendq.shown = sendq.count;
+  if (sendq.count > 0) /* lines held back by flood control */
+    snprintf(prompt, sizeof(prompt), "%s[%d]%c ", channel, sendq.count, sep);
+  else
+    snprintf(prompt, sizeof(prompt), "%s%c ", channel, sep);
   rl_set_prompt(prompt);
-  rl_on_new_line_with_prompt();
-  rl_redisplay();
+  if (!render.open) /* else the batch draws it */
+    rl_redisplay();
 }
 
-static void sout(char *fmt, ...) {
-  va_list ap;
-  int len = 0;
+/* Lines at the front of the queue that must go out first: the head if
+ * it is half written, or every line of a TLS write that has to be
+ * retried, as OpenSSL may already hold any of them in a record. */
+static int sendq_started() {
+  if (sendq.retry)
+    return sendq.batch;
+  return sendq.off ? 1 : 0;
+}
 
-  va_start(ap, fmt);
+static void vsout(bool urgent, const char *fmt, va_list ap) {
+  struct send_line *l;
+  struct timespec t0;
+  char dropped[IRC_LINE_MAX];
+  int len, ahead, i;
+
+  stats_start(&t0);
   len = vsnprintf(bufout, sizeof(bufout), fmt, ap);
-  va_end(ap);
   /*    fprintf(stdout, "\nSRV: '%s'<END>\n", bufout); */
-  if (use_ssl) {
-    char *full_bufout = malloc(len + 3);
-    len = snprintf(full_bufout, len + 3, "%s\r\n", bufout);
-    if (SSL_write(ssl, full_bufout, len) <= 0) {
-      eprint("Unable to write over SSL");
-    }
-    free(full_bufout);
+  if (len < 0)
+    return;
+  if (len > IRC_LINE_MAX - 2)
+    len = IRC_LINE_MAX - 2; /* servers cut longer lines anyway */
+  if (conn < CONN_REGISTERING || sendq.count == SENDQ_LINES) {
+    /* pout() formats into bufout too */
+    memcpy(dropped, bufout, len);
+    dropped[len] = '\0';
+    if (conn < CONN_REGISTERING)
+      pout("ircl", "Error: not connected; dropped: %s", dropped);
+    else
+      pout("ircl", "Error: send queue full (%d lines); dropped: %s",
+           SENDQ_LINES, dropped);
+    stats.lines_dropped++;
+    stats_stop(ST_SOUT, &t0);
+    return;
+  }
+  if (urgent) {
+    /* jump the queue, but not the lines already on their way out */
+    ahead = sendq_started();
+    sendq.head = (sendq.head + SENDQ_LINES - 1) % SENDQ_LINES;
+    for (i = 0; i < ahead; i++)
+      sendq.lines[(sendq.head + i) % SENDQ_LINES] =
+          sendq.lines[(sendq.head + i + 1) % SENDQ_LINES];
+    l = &sendq.lines[(sendq.head + ahead) % SENDQ_LINES];
   } else {
-    fprintf(srv, "%s\r\n", bufout);
+    l = &sendq.lines[(sendq.head + sendq.count) % SENDQ_LINES];
+  }
+  memcpy(l->buf, bufout, len);
+  memcpy(l->buf + len, "\r\n", 2);
+  l->len = len + 2;
+  l->urgent = urgent;
+  sendq.count++;
+  send_flush();
+  stats_stop(ST_SOUT, &t0);
+}
+
+static void sout(char *fmt, ...) {
+  va_list ap;
+
+  va_start(ap, fmt);
+  vsout(false, fmt, ap);
+  va_end(ap);
+}
+
+/* for PING/PONG: not held back by flood control */
+static void sout_urgent(char *fmt, ...) {
+  va_list ap;
+
+  va_start(ap, fmt);
+  vsout(true, fmt, ap);
+  va_end(ap);
+}
+
+/* top up the flood control budget for the time since the last refill */
+static void sendq_refill() {
+  struct timespec now;
+  long elapsed;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  elapsed = (now.tv_sec - sendq.refilled.tv_sec) * 1000 +
+            (now.tv_nsec - sendq.refilled.tv_nsec) / 1000000;
+  if (elapsed <= 0)
+    return;
+  sendq.budget_ms += elapsed;
+  if (sendq.budget_ms > FLOOD_BURST * FLOOD_INTERVAL_MS)
+    sendq.budget_ms = FLOOD_BURST * FLOOD_INTERVAL_MS;
+  sendq.refilled = now;
+}
+
+/* Write as many queued lines as flood control allows in one writev() or
+ * SSL_write(). Whatever the socket doesn't take goes out when the loop
+ * reports it writable; lines over budget wait for pacer_timer. */
+static void send_flush() {
+  struct iovec iov[IOV_BATCH];
+  struct send_line *l;
+  struct timespec t0;
+  long budget;
+  int i, nlines = 0, n;
+  size_t staged = 0, off;
+
+  if (srv == -1 || conn < CONN_REGISTERING)
+    return;
+  sendq_refill();
+  budget = sendq.budget_ms;
+  for (i = 0; i < sendq.count && nlines < IOV_BATCH; i++) {
+    l = &sendq.lines[(sendq.head + i) % SENDQ_LINES];
+    off = i == 0 ? sendq.off : 0;
+    if (off == 0 && !l->urgent) {
+      if (budget < FLOOD_INTERVAL_MS)
+        break;
+      budget -= FLOOD_INTERVAL_MS;
+    }
+    if (use_ssl) {
+      if (staged + l->len - off > sizeof(sendq.stage))
+        break;
+      memcpy(sendq.stage + staged, l->buf + off, l->len - off);
+    } else {
+      iov[nlines].iov_base = l->buf + off;
+      iov[nlines].iov_len = l->len - off;
+    }
+    staged += l->len - off;
+    nlines++;
   }
+  if (nlines > 0) {
+    if (use_ssl) {
+      stats_start(&t0);
+      n = SSL_write(ssl, sendq.stage, staged);
+      stats_stop(ST_SSL_WRITE, &t0);
+      sendq.retry = n <= 0; /* the next write must start with these bytes */
+      sendq.batch = nlines;
+      if (n <= 0) {
+        n = SSL_get_error(ssl, n);
+        if (n != SSL_ERROR_WANT_WRITE && n != SSL_ERROR_WANT_READ) {
+          fprintf(stderr, "ERROR: Unable to write over SSL (err=%d)\n", n);
+          sendq.count = sendq.off = 0; /* the read side will reconnect */
+          sendq.retry = false;
+        }
+        n = 0;
+      }
+    } else {
+      do {
+        n = writev(srv, iov, nlines);
+      } while (n == -1 && errno == EINTR);
+      if (n == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          fprintf(stderr, "ERROR: Unable to write to server: %s\n",
+                  strerror(errno));
+          sendq.count = sendq.off = 0;
+        }
+        n = 0;
+      }
+    }
+    stats.bytes_out += n;
+    /* retire what was written, charging each new line to the budget */
+    while (n > 0 && sendq.count > 0) {
+      l = &sendq.lines[sendq.head];
+      if (sendq.off == 0 && !l->urgent)
+        sendq.budget_ms -= FLOOD_INTERVAL_MS;
+      if ((size_t)n < l->len - sendq.off) {
+        sendq.off += n;
+        break;
+      }
+      n -= l->len - sendq.off;
+      sendq.off = 0;
+      sendq.head = (sendq.head + 1) % SENDQ_LINES;
+      sendq.count--;
+      stats.lines_out++;
+    }
+  }
+  /* half a line out means the socket is full; otherwise it's the budget */
+  ev_io_mod(srv, (sendq.off || sendq.retry) ? EV_READ | EV_WRITE : EV_READ);
+  if (sendq.count > 0 && sendq.off == 0 && !sendq.retry)
+    ev_timer_arm(&pacer_timer, FLOOD_INTERVAL_MS - sendq.budget_ms);
+  else
+    ev_timer_cancel(&pacer_timer);
+  if (sendq.count != sendq.shown)
+    update_prompt(default_channel);
 }
 
 static void privmsg(char *channel, char *msg) {
@@ -371,8 +1491,9 @@ static void privmsg(char *channel, char *msg) {
     pout("ircl", "No channel to send to");
     return;
   }
-  insert_nick(channel);
-  pout(channel, "<" COLOR_OUTGOING "%s" COLOR_RESET "> %s", default_nick, msg);
+  emit(&(struct irc_event){.kind = MSG_PRIVMSG, .time = time(NULL),
+                           .source = default_nick, .target = channel,
+                           .text = msg});
   sout("PRIVMSG %s :%s", channel, msg);
 }
 
@@ -404,26 +1525,322 @@ static void handle_help() {
                "\th help   - display this message\n"
                "\tj join   - JOIN <channel>\n"
                "\tp part   - PART [<channel>]\n"
-               "\tl last   - replay last messages from <channel>\n"
+               "\tl last   - replay last [N] messages from <channel>\n"
                "\tm msg    - PRIVMSG <channel or nick> <msg>\n"
                "\ta me     - ACTION <msg>\n"
                "\ts switch - change channel to <channel> or list channels and "
                "return to default\n"
-               "\tw who    - WHO [<channel>]\n"
-               "\tW whoa   - WHO *\n"
+               "\tw who    - WHO [-q] [-h] [<channel> [<pattern>]]\n"
+               "\tW whoa   - WHO * [-q] [-h] [<pattern>]\n"
+               "\tn names  - NAMES [-q] [<channel> [<pattern>]]\n"
+               "\tS stats  - show timings and counters\n"
                "\tQ quit   - quit\n");
 }
 
-static void handle_who_all() { sout("WHO *"); }
+/* [-q] [-h] [target [pattern]] */
+static void listing_args(const char *args, struct listing_opts *o) {
+  char buf[256], *w;
+
+  memset(o, 0, sizeof *o);
+  strlcpy(buf, args ? args : "", sizeof buf);
+  for (w = strtok(buf, " "); w; w = strtok(NULL, " ")) {
+    if (!strcmp(w, "-q"))
+      o->quiet = true;
+    else if (!strcmp(w, "-h"))
+      o->by_host = true;
+    else if (!o->target[0])
+      strlcpy(o->target, w, sizeof o->target);
+    else
+      strlcpy(o->pattern, w, sizeof o->pattern);
+  }
+  for (w = o->pattern; *w; w++)
+    *w = tolower((unsigned char)*w); /* matched against folded rows */
+}
 
-static void handle_who_channel(const char *args) {
-  if (args && *args) {
-    sout("WHO %s", args);
-  } else if (!in_ircl_channel()) {
-    sout("WHO %s", default_channel);
+/* remember how to show the reply to a request just sent */
+static void listing_push(struct listing *l, const struct listing_opts *o) {
+  if (l->npending == LISTING_PENDING) {
+    memmove(l->pending, l->pending + 1,
+            (LISTING_PENDING - 1) * sizeof *l->pending);
+    l->npending--;
+  }
+  l->pending[l->npending++] = *o;
+}
+
+static void listing_reset(struct listing *l) {
+  l->open = false;
+  l->rows = 0;
+  l->used = l->size ? 1 : 0;
+  l->npending = 0;
+}
+
+/* Called for every row; the first of a list picks its options: the
+ * request for that target, else (WHO only) the oldest one, else the
+ * defaults. Returns false when the rows needn't be kept. */
+static bool listing_begin(struct listing *l, const char *target) {
+  int i;
+
+  if (l->open)
+    return !l->cur.quiet;
+  for (i = 0; i < l->npending; i++) {
+    if (target && !irc_strcasecmp(l->pending[i].target, target))
+      break;
+  }
+  if (i == l->npending && !target && l->npending)
+    i = 0;
+  if (i < l->npending) {
+    l->cur = l->pending[i];
+    memmove(l->pending + i, l->pending + i + 1,
+            (l->npending - i - 1) * sizeof *l->pending);
+    l->npending--;
   } else {
+    memset(&l->cur, 0, sizeof l->cur);
+    l->cur.quiet = l->quiet_default;
+  }
+  l->open = true;
+  return !l->cur.quiet;
+}
+
+static unsigned listing_str(struct listing *l, const char *str) {
+  size_t len = strlen(str) + 1;
+
+  if (l->used == 0)
+    l->used = 1; /* "" */
+  if (l->used + len > l->size) {
+    l->size = MAX(l->size * 2, l->used + len + LISTING_POOL);
+    if (!(l->pool = realloc(l->pool, l->size)))
+      eprint("ircl: realloc:");
+    l->pool[0] = '\0';
+  }
+  memcpy(l->pool + l->used, str, len);
+  l->used += len;
+  return l->used - len;
+}
+
+/* one row; columns that don't apply are NULL */
+static void listing_add(struct listing *l, const char *vals[LC_COUNT]) {
+  int c;
+
+  if (l->rows == l->cap) {
+    l->cap = l->cap ? l->cap * 2 : LISTING_ROWS;
+    for (c = 0; c < LC_COUNT; c++) {
+      if (!(l->cols[c] = realloc(l->cols[c], l->cap * sizeof(unsigned))))
+        eprint("ircl: realloc:");
+    }
+    if (!(l->order = realloc(l->order, l->cap * sizeof(size_t))))
+      eprint("ircl: realloc:");
+  }
+  for (c = 0; c < LC_COUNT; c++)
+    l->cols[c][l->rows] = vals[c] && *vals[c] ? listing_str(l, vals[c]) : 0;
+  l->rows++;
+}
+
+#define LISTING_COL(l, c, r) ((l)->pool + (l)->cols[c][r])
+
+static void listing_printf(struct listing *l, const char *fmt, ...) {
+  va_list ap;
+  int n;
+
+  for (;;) {
+    va_start(ap, fmt);
+    n = vsnprintf(l->text ? l->text + l->len : NULL, l->text_size - l->len,
+                  fmt, ap);
+    va_end(ap);
+    if (n >= 0 && l->len + n < l->text_size)
+      break;
+    l->text_size = MAX(l->text_size * 2, l->len + n + RENDER_BUF_SIZE);
+    if (!(l->text = realloc(l->text, l->text_size)))
+      eprint("ircl: realloc:");
+  }
+  l->len += n;
+}
+
+static const struct listing *sorting; /* for qsort() */
+
+static int prefix_rank(const char *prefix) {
+  const char *p = *prefix ? strchr("~&@%+", *prefix) : NULL;
+
+  return p ? p - "~&@%+" : 5;
+}
+
+static int listing_cmp(const void *a, const void *b) {
+  const struct listing *l = sorting;
+  size_t x = *(const size_t *)a, y = *(const size_t *)b;
+  int r = 0;
+
+  if (l->cur.by_host && l == &who_list)
+    r = strcasecmp(LISTING_COL(l, LC_USERHOST, x),
+                   LISTING_COL(l, LC_USERHOST, y));
+  else if (l == &names_list)
+    r = prefix_rank(LISTING_COL(l, LC_FLAGS, x)) -
+        prefix_rank(LISTING_COL(l, LC_FLAGS, y));
+  if (r == 0)
+    r = irc_strcasecmp(LISTING_COL(l, LC_NICK, x), LISTING_COL(l, LC_NICK, y));
+  return r;
+}
+
+/* the pattern against nick, user@host, server or name, ignoring case */
+static bool listing_match(const struct listing *l, size_t r) {
+  const char *pat = l->cur.pattern, *str;
+  char folded[IRC_LINE_MAX];
+  size_t i;
+  int c;
+
+  if (!*pat)
+    return true;
+  for (c = 0; c < LC_COUNT; c++) {
+    if (c == LC_FLAGS)
+      continue;
+    str = LISTING_COL(l, c, r);
+    for (i = 0; str[i] && i < sizeof folded - 1; i++)
+      folded[i] = tolower((unsigned char)str[i]);
+    folded[i] = '\0';
+    if (fnmatch(pat, folded, 0) == 0)
+      return true;
+  }
+  return false;
+}
+
+static bool listing_away(const struct listing *l, size_t r) {
+  struct nick_entry *nick_ent;
+
+  if (l == &who_list)
+    return LISTING_COL(l, LC_FLAGS, r)[0] == 'G';
+  return (nick_ent = find_nick(LISTING_COL(l, LC_NICK, r))) && nick_ent->away;
+}
+
+/* the rows, as aligned columns (WHO) or as many names a line as fit
+ * (NAMES); with stamp, each line starts like a log line */
+static void listing_table(struct listing *l, size_t shown, const char *stamp,
+                          bool color) {
+  size_t i, r, width[LC_COUNT] = {0}, len, per_line;
+  bool last;
+  int c, cols, rows_on_screen;
+
+  for (i = 0; i < shown; i++) {
+    r = l->order[i];
+    for (c = 0; c < LC_COUNT; c++) {
+      len = strlen(LISTING_COL(l, c, r));
+      if (len > width[c])
+        width[c] = len;
+    }
+  }
+  if (width[LC_USERHOST] > LISTING_HOST_MAX)
+    width[LC_USERHOST] = LISTING_HOST_MAX;
+  if (width[LC_SERVER] > LISTING_SERVER_MAX)
+    width[LC_SERVER] = LISTING_SERVER_MAX;
+
+  if (l == &who_list) {
+    for (i = 0; i < shown; i++) {
+      r = l->order[i];
+      listing_printf(l, "%s%s%-*s%s %-*s %-*.*s %-*.*s %s\n", stamp,
+                     color && !listing_away(l, r) ? COLOR_INCOMING : "",
+                     (int)width[LC_NICK], LISTING_COL(l, LC_NICK, r),
+                     color ? COLOR_RESET : "", (int)width[LC_FLAGS],
+                     LISTING_COL(l, LC_FLAGS, r), (int)width[LC_USERHOST],
+                     (int)width[LC_USERHOST], LISTING_COL(l, LC_USERHOST, r),
+                     (int)width[LC_SERVER], (int)width[LC_SERVER],
+                     LISTING_COL(l, LC_SERVER, r), LISTING_COL(l, LC_NAME, r));
+    }
+    return;
+  }
+  rl_get_screen_size(&rows_on_screen, &cols);
+  if (cols <= 0)
+    cols = 80;
+  len = width[LC_NICK] + 3; /* prefix, nick, two spaces */
+  per_line = MAX((cols - (int)strlen(stamp)) / (int)len, 1);
+  for (i = 0; i < shown; i++) {
+    r = l->order[i];
+    last = i % per_line == per_line - 1 || i == shown - 1;
+    listing_printf(l, "%s%s%s%-*s%s%s", i % per_line ? "" : stamp,
+                   *LISTING_COL(l, LC_FLAGS, r) ? LISTING_COL(l, LC_FLAGS, r)
+                                                : " ",
+                   color && !listing_away(l, r) ? COLOR_INCOMING : "",
+                   last ? 0 : (int)len - 1, LISTING_COL(l, LC_NICK, r),
+                   color ? COLOR_RESET : "", last ? "\n" : "");
+  }
+}
+
+/* the end numeric: show the collected rows once, in one write to the
+ * screen and one to the log, and get ready for the next list */
+static void listing_end(struct listing *l, const char *target,
+                        const char *source) {
+  const char *window = find_channel(target) ? target : source;
+  char stamp[64], timestr[32];
+  size_t i, shown = 0;
+  unsigned long away = 0;
+  time_t now = time(NULL);
+
+  listing_begin(l, target); /* an empty list */
+  if (!l->cur.quiet) {
+    for (i = 0; i < l->rows; i++) {
+      if (!listing_match(l, i))
+        continue;
+      l->order[shown++] = i;
+      away += listing_away(l, i);
+    }
+    sorting = l;
+    qsort(l->order, shown, sizeof *l->order, listing_cmp);
+    if (*l->cur.pattern)
+      pout(window, "%s %s: %zu of %zu matching %s, %lu away", l->what, target,
+           shown, l->rows, l->cur.pattern, away);
+    else
+      pout(window, "%s %s: %zu, %lu away", l->what, target, shown, away);
+    if (shown) {
+      render_begin();
+      l->len = 0;
+      listing_table(l, shown, "        ", true);
+      fwrite(l->text, 1, l->len, rl_outstream);
+      render.nlines += shown;
+      strftime(timestr, sizeof timestr, "%D %T", localtime(&now));
+      snprintf(stamp, sizeof stamp, "%s : %s   ", timestr, window);
+      l->len = 0;
+      listing_table(l, shown, stamp, false);
+      logmsg(l->text, l->len);
+    }
+  }
+  l->open = false;
+  l->rows = 0;
+  l->used = l->size ? 1 : 0;
+}
+
+static void handle_who_all(const char *args) {
+  struct listing_opts o;
+
+  listing_args(args, &o);
+  if (o.target[0] && !o.pattern[0])
+    strlcpy(o.pattern, o.target, sizeof o.pattern);
+  strlcpy(o.target, "*", sizeof o.target);
+  listing_push(&who_list, &o);
+  sout("WHO *");
+}
+
+static void handle_who_channel(const char *args) {
+  struct listing_opts o;
+
+  listing_args(args, &o);
+  if (!o.target[0] && !in_ircl_channel())
+    strlcpy(o.target, default_channel, sizeof o.target);
+  if (!o.target[0]) {
+    pout("ircl", "Specify a channel.");
+    return;
+  }
+  listing_push(&who_list, &o);
+  sout("WHO %s", o.target);
+}
+
+static void handle_names(const char *args) {
+  struct listing_opts o;
+
+  listing_args(args, &o);
+  if (!o.target[0] && !in_ircl_channel())
+    strlcpy(o.target, default_channel, sizeof o.target);
+  if (!o.target[0]) {
     pout("ircl", "Specify a channel.");
+    return;
   }
+  listing_push(&names_list, &o);
+  sout("NAMES %s", o.target);
 }
 
 static void handle_away(const char *args) {
@@ -463,13 +1880,12 @@ static void handle_msg(const char *args) {
     return;
   }
 
-  channel = strdup(args);
+  channel = arena_strdup(args);
   msg = eat(channel, isspace, 0);
   if (*msg)
     *msg++ = '\0';
   update_active_nicks(channel);
   privmsg(channel, msg);
-  free(channel);
 }
 
 static void handle_me(const char *args) {
@@ -480,24 +1896,25 @@ static void handle_me(const char *args) {
 
   if (!in_ircl_channel()) {
     sout("PRIVMSG %s \1ACTION %s", default_channel, args);
-    pout(default_channel, "* " COLOR_OUTGOING "%s" COLOR_RESET " %s",
-         default_nick, args);
+    emit(&(struct irc_event){.kind = MSG_ACTION, .time = time(NULL),
+                             .source = default_nick, .target = default_channel,
+                             .text = args});
   } else {
     pout("ircl", "No channel to send to");
   }
 }
 
 static void handle_switch(const char *args) {
+  struct irc_channel *chan;
+
   if (!*args) {
-    int i;
-    const char *name, *color;
     pout("ircl", "Active Channels:");
-    for (i = 0; i < MAX_CHANNELS; i++) {
-      name = active_channels[i].name;
-      color = active_channels[i].color;
-      if (name) {
-        pout("ircl", "    %s%s%s", color, name, COLOR_RESET);
-      }
+    TAILQ_FOREACH(chan, &channels.order, joined) {
+      pout("ircl", "    %s%-20s" COLOR_RESET " %5d users %-6s %lu unread "
+                   "(%lu for you)  %.60s",
+           chan->color, chan->name, chan->nmembers,
+           chan->modes[0] ? chan->modes : "-", chan->unread, chan->mentions,
+           chan->topic);
     }
     strlcpy(default_channel, IRCL_CHANNEL_NAME, sizeof default_channel);
     update_prompt(default_channel);
@@ -505,22 +1922,69 @@ static void handle_switch(const char *args) {
     char *channel;
     char *msg;
 
-    channel = strdup(args);
+    channel = arena_strdup(args);
     msg = eat(channel, isspace, 0);
     if (*msg) {
       *msg++ = '\0';
       privmsg(channel, msg);
     }
     strlcpy(default_channel, channel, sizeof default_channel);
-    free(channel);
+    if ((chan = find_channel(channel)))
+      chan->unread = chan->mentions = 0;
     update_prompt(default_channel);
     pout("ircl", "-> %s%s%s", channel_color(default_channel), default_channel,
          COLOR_RESET);
   }
 }
 
+static void handle_stats() {
+  const struct histogram *h;
+  long up = ms_since(&stats.started) / 1000;
+  int i;
+
+  pout("ircl", "Stats for the last %ldh%02ldm%02lds:", up / 3600,
+       up / 60 % 60, up % 60);
+  for (i = 0; i < ST_COUNT; i++) {
+    h = &stats.timers[i];
+    if (h->count)
+      pout("ircl", "    %-9s %9lu calls, avg %7.1f us, p50 <%lu us, "
+                   "p99 <%lu us, max %llu us",
+           stat_names[i], h->count, h->total_ns / 1e3 / h->count,
+           stats_percentile(h, 50), stats_percentile(h, 99),
+           h->max_ns / 1000);
+  }
+  pout("ircl", "    in  %lu lines, %llu bytes (%lu overlong lines split)",
+       stats.lines_in, stats.bytes_in, rbuf.dropped);
+  pout("ircl", "    out %lu lines, %llu bytes (%lu dropped, %d queued)",
+       stats.lines_out, stats.bytes_out, stats.lines_dropped, sendq.count);
+  pout("ircl", "    nicks %zu of %zu, scrollback %zu rings, %zu lines, "
+               "%zu KB",
+       nicks.count, nicks.capacity, scrollbacks.count, scrollback_lines(),
+       scrollbacks.arena / 1024);
+  pout("ircl", "    rendered %lu lines in %lu batches, lag %ld ms",
+       render.lines, render.batches, stats.lag_ms);
+  pout("ircl", "    users %zu names%s, %lu reloads, %lu added, %lu removed",
+       users.count, users.indexed ? "" : " (not indexed yet)", users.reloads,
+       users.added, users.removed);
+}
+
 static void handle_quit() {
-  sout("QUIT Peace.");
+  unsigned long quit_out = stats.lines_out + sendq_started() + 1;
+  struct timespec started;
+  struct pollfd pfd;
+  long left;
+
+  /* past flood control, and then wait for it: the socket may be full */
+  sout_urgent("QUIT Peace.");
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  while (srv != -1 && sendq.count > 0 && stats.lines_out < quit_out &&
+         (left = QUIT_DRAIN_MS - ms_since(&started)) > 0) {
+    pfd.fd = srv;
+    pfd.events = POLLOUT;
+    /* TLS may want to read first: retry now and then regardless */
+    poll(&pfd, 1, left < 100 ? left : 100);
+    send_flush();
+  }
   exit(0);
 }
 
@@ -536,7 +2000,7 @@ static void parsein(char *s) {
     if (!in_ircl_channel()) {
       privmsg(default_channel, s);
     } else if (strchr(s, ':')) {
-      char *channel = strdup(s);
+      char *channel = arena_strdup(s);
       char *msg = eat(channel, is_colon, 0);
       *msg++ = '\0';
       while (*msg && isspace(*msg)) {
@@ -547,8 +2011,6 @@ static void parsein(char *s) {
       } else {
         pout("ircl", "Specify a message");
       }
-      free(channel);
-      channel = NULL;
     } else {
       pout("ircl", "Specify a channel");
     }
@@ -568,322 +2030,1210 @@ static void parsein(char *s) {
   sout("%s", s);
 }
 
-static void parsesrv(char *cmd) {
-  char *usr, *par, *txt;
-
-  usr = host;
-  if (!cmd || !*cmd)
-    return;
-  if (cmd[0] == ':') {
-    usr = cmd + 1;
-    cmd = skip(usr, ' ');
-    if (cmd[0] == '\0')
-      return;
-    skip(usr, '!');
+/* Split a raw server line into m without copying: the line is cut up in
+ * place and every field of m points into it. Returns 0 when there is no
+ * command to dispatch. */
+static int parse_irc_msg(char *line, struct irc_msg *m) {
+  char *p = line, *x;
+
+  m->tags = NULL;
+  m->nick = host; /* no prefix: it came from the server itself */
+  m->user = m->host = "";
+  m->nparams = 0;
+  if (*p == '@') {
+    m->tags = p + 1;
+    p = skip(p, ' ');
   }
-  skip(cmd, '\r');
-  par = skip(cmd, ' ');
-  txt = skip(par, ':');
-  trim(par);
-
-  if (!strcmp("PONG", cmd))
-    return;
-  if (!strcmp("PRIVMSG", cmd)) {
-    update_active_nicks(usr);
-    if (strncmp(txt, "\1ACTION ", 8) == 0) {
-      /* action */
-      txt += 8;
-      pout(par, "* " COLOR_INCOMING "%s" COLOR_RESET " %s", usr, txt);
-    } else {
-      char *highlighted_txt = highlight_user(txt);
-      if (highlighted_txt) {
-        pout(par, "<" COLOR_INCOMING "%s" COLOR_RESET "> %s", usr,
-             highlighted_txt);
-        free(highlighted_txt);
-        highlighted_txt = NULL;
-      } else {
-        pout(par, "<" COLOR_INCOMING "%s" COLOR_RESET "> %s", usr, txt);
-      }
+  while (*p == ' ')
+    p++;
+  if (*p == ':') {
+    m->nick = p + 1;
+    p = skip(p, ' ');
+    if ((x = strchr(m->nick, '@'))) {
+      *x++ = '\0';
+      m->host = x;
     }
-    insert_nick(usr);
-  } else if (!strcmp("PING", cmd)) {
-    char *host = (*txt) ? txt : par;
-    sout("PONG %s", host);
-  } else {
-    if (strcmp(cmd, "JOIN") == 0) {
-      char *channel = (*txt) ? txt : par;
-      if (!strcmp(usr, default_nick)) {
-        add_channel(channel);
-        pout(usr, "> joined %s%s%s", channel_color(channel), channel,
-             COLOR_RESET);
-        /* if we joined a room, add it to tab-complete */
-        insert_nick(channel);
-      }
-      if (nick_is_active(usr)) {
-        pout(usr, "> joined %s%s%s", channel_color(channel), channel,
-             COLOR_RESET);
-      }
-      insert_nick(usr);
-    } else if ((strcmp(cmd, "QUIT") == 0) || (strcmp(cmd, "PART") == 0)) {
-      char *channel = par;
-      if (!strcmp(usr, default_nick)) {
-        remove_channel(channel);
-        pout(usr, "> left %s %s", channel, txt);
-        if (!strcmp(channel, default_channel)) {
-          strlcpy(default_channel, IRCL_CHANNEL_NAME, sizeof default_channel);
-          update_prompt(default_channel);
-        }
-      } else if (nick_is_active(usr)) {
-        pout(usr, "> left %s %s", channel, txt);
-      }
-      remove_nick(usr);
-    } else if (strcmp(cmd, "NICK") == 0) {
-      pout(usr, "> is now known as " COLOR_CHANNEL "%s" COLOR_RESET, txt);
-      remove_nick(usr);
-      insert_nick(txt);
-      if (strcmp(usr, default_nick) == 0) {
-        strlcpy(default_nick, txt, sizeof default_nick);
-      }
-    } else if (strcmp(cmd, "NOTICE") == 0) {
-      insert_nick(usr);
-      pout(usr, "NOTICE > %s", txt);
-    } else if (strcmp(cmd, "MODE") == 0) {
-      /* eat it */
-    } else if (strcmp(cmd, "001") == 0) {
-      /* welcome message, make sure correct nick is stored. */
-      skip(par, ' '); /* strip anything beyond a space */
-      strlcpy(default_nick, par, sizeof default_nick);
-      pout(usr, "> is now known as " COLOR_CHANNEL "%s" COLOR_RESET, par);
-      insert_nick(par);
-    } else if (strcmp(cmd, "366") == 0) {
-      /* end of names list, do nothing */
-    } else if (strcmp(cmd, "332") == 0) {
-      /* channel topic */
-      pout(usr, "%s TOPIC: %s", par, txt);
-    } else if (strcmp(cmd, "315") == 0) {
-      /* end of who list, do nothing */
-    } else if (strcmp(cmd, "352") == 0) {
-      /* who response */
-      char *name = strtok(par, " ");
-      char *state;
-      int i = 0;
-      for (i = 0; i < 5; i++) {
-        name = strtok(NULL, " ");
-      }
-      state = strtok(NULL, " ");
-      pout(usr, "%s %s", name, state);
-    } else if (strcmp(cmd, "353") == 0) {
-      /* names response */
-      char *client = strtok(txt, " ");
-      while (client) {
-        if (client[0] == '@') {
-          /* remove @ from operators */
-          client++;
-        }
-        insert_nick(client);
-        client = strtok(NULL, " ");
-      }
-    } else if (strcmp(cmd, "306") == 0) {
-      /* away */
-      is_away = 1;
-      update_prompt(default_channel);
-      pout(usr, "AWAY: %s", txt);
-    } else if (strcmp(cmd, "305") == 0) {
-      /* not away */
-      is_away = 0;
-      update_prompt(default_channel);
-      pout(usr, "BACK: %s", txt);
-    } else {
-      pout(usr, ">< %s (%s): %s", cmd, par, txt);
+    if ((x = strchr(m->nick, '!'))) {
+      *x++ = '\0';
+      m->user = x;
+    }
+  }
+  while (*p == ' ')
+    p++;
+  m->cmd = p;
+  p = skip(p, ' ');
+  if (*m->cmd == '\0')
+    return 0;
+  while (m->nparams < IRC_MAX_PARAMS) {
+    while (*p == ' ')
+      p++;
+    if (*p == '\0')
+      break;
+    if (*p == ':' || m->nparams == IRC_MAX_PARAMS - 1) {
+      /* trailing parameter: the rest of the line, spaces and all */
+      m->params[m->nparams++] = p + (*p == ':');
+      break;
     }
+    m->params[m->nparams++] = p;
+    p = skip(p, ' ');
   }
+  m->trailing = m->nparams ? m->params[m->nparams - 1] : "";
+  return 1;
 }
 
-static void update_active_nicks(const char *nick) {
-  /* Maintain a queue of the 10 most recent nicks to say something.
-   * Then mute everyone else's join/part activity. */
+/* "2024-01-31T12:34:56.789Z" in epoch milliseconds, or -1 */
+static long long parse_server_time(const char *s) {
+  struct tm tm = {0};
+  int ms = 0, n = 0;
+
+  if (sscanf(s, "%d-%d-%dT%d:%d:%d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+             &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &n) != 6)
+    return -1;
+  if (s[n] == '.')
+    sscanf(s + n + 1, "%3d", &ms);
+  tm.tm_year -= 1900;
+  tm.tm_mon--;
+  return (long long)timegm(&tm) * 1000 + ms;
+}
+
+static struct irc_batch *find_batch(const char *ref) {
   int i;
-  static int next_available = -1;
 
-  if (next_available < 0) {
-    /* initialize first */
-    for (i = 0; i < ACTIVE_NICKS_QUEUE_SIZE; i++) {
-      active_nicks[i] = NULL;
-    }
-    next_available = 0;
+  for (i = 0; i < ircv3.nbatches; i++) {
+    if (!strcmp(ircv3.batches[i].ref, ref))
+      return &ircv3.batches[i];
   }
+  return NULL;
+}
 
-  for (i = 0; i < ACTIVE_NICKS_QUEUE_SIZE; i++) {
-    if (active_nicks[i] && (strcasecmp(active_nicks[i], nick) == 0)) {
-      /* already in active queue, so skip */
-      return;
+/* Pick out the tags we use: server-time and batch. The tags are cut up in
+ * place; their values don't need unescaping. */
+static void parse_tags(struct irc_msg *m) {
+  char *tag = m->tags, *next, *value;
+  long long ms;
+
+  while (tag && *tag) {
+    if ((next = strchr(tag, ';')))
+      *next++ = '\0';
+    if ((value = strchr(tag, '=')))
+      *value++ = '\0';
+    if (value && !strcmp(tag, "time") && (ms = parse_server_time(value)) >= 0) {
+      m->ms = ms;
+      m->time = ms / 1000;
+    } else if (value && !strcmp(tag, "batch")) {
+      m->batch = find_batch(value);
     }
+    tag = next;
   }
-  if (active_nicks[next_available]) {
-    free((char *)active_nicks[next_available]);
-    active_nicks[next_available] = NULL;
-  }
-  active_nicks[next_available] = strdup(nick);
-  next_available = (next_available + 1) % ACTIVE_NICKS_QUEUE_SIZE;
 }
 
-static int nick_is_active(const char *nick) {
+/* concatenate params [from, nparams - 1) with spaces, for display */
+static const char *middle_params(const struct irc_msg *m, int from, char *buf,
+                                 size_t len) {
+  size_t off = 0;
   int i;
 
-  for (i = 0; i < ACTIVE_NICKS_QUEUE_SIZE; i++) {
-    if (active_nicks[i] && (strcasecmp(active_nicks[i], nick) == 0)) {
-      return 1;
-    }
+  buf[0] = '\0';
+  for (i = from; i < m->nparams - 1 && off < len; i++)
+    off += snprintf(buf + off, len - off, "%s%s", i > from ? " " : "",
+                    m->params[i]);
+  return buf;
+}
+
+/* Note how far a channel's messages go, for the next CHATHISTORY. True
+ * for a history line that came after our JOIN, as we saw that one live. */
+static bool history_seen(const struct irc_msg *m) {
+  struct irc_channel *chan = find_channel(IRC_PARAM(m, 0));
+
+  if (!chan)
+    return false;
+  if (m->batch && m->batch->history) {
+    if (chan->live_ms && m->ms >= chan->live_ms)
+      return true;
+    chan->history_lines++;
   }
-  return 0;
+  if (m->ms > chan->last_ms)
+    chan->last_ms = m->ms;
+  return false;
 }
 
-void login() {
-  int i;
+static void format_server_time(char *buf, size_t size, long long ms) {
+  time_t t = ms / 1000;
+  char date[32];
 
-  if (srv != NULL) {
-    fclose(srv); // check return value/errno?
-    srv = NULL;
-  }
-  if (ssl != NULL) {
-    SSL_free(ssl);
-    ssl = NULL;
-  }
-  i = dial(host, port);
-  if (use_ssl) {
-    ssl_connect(i, host);
-  }
-  srv = fdopen(i, "r+");
-  /* login */
-  if (password)
-    sout("PASS %s", password);
-  sout("NICK %s", default_nick);
-  sout("USER %s localhost %s :%s", default_nick, host, default_nick);
-  if (!use_ssl) {
-    fflush(srv);
-    setbuf(srv, NULL);
-  }
-  setbuf(stdout, NULL);
-  set_default_channel();
+  strftime(date, sizeof date, "%Y-%m-%dT%H:%M:%S", gmtime(&t));
+  snprintf(buf, size, "%s.%03dZ", date, (int)(ms % 1000));
 }
 
-int insert_nick(const char *nick) {
-  struct nick_entry *nick_ent;
+/* lines per CHATHISTORY request: ours, or the server's if lower */
+static int history_limit() {
+  if (ircv3.history_max > 0 && ircv3.history_max < HISTORY_LINES)
+    return ircv3.history_max;
+  return HISTORY_LINES;
+}
 
-  remove_nick(nick); /* put nick at head of list */
+/* the next page of what we missed in a channel */
+static void history_request(struct irc_channel *chan, long long after_ms) {
+  char ts[40];
 
-  nick_ent = malloc(sizeof(struct nick_entry));
-  nick_ent->nick = strdup(nick);
-  LIST_INSERT_HEAD(&nick_list_head, nick_ent, entries);
-  return 1;
+  chan->history_pages++;
+  format_server_time(ts, sizeof ts, after_ms);
+  sout("CHATHISTORY AFTER %s timestamp=%s %d", chan->name, ts,
+       history_limit());
 }
 
-int remove_nick(const char *nick) {
-  struct nick_entry *nick_ent;
+static void srv_privmsg(struct irc_msg *m) {
+  struct irc_event ev = {.kind = MSG_PRIVMSG, .time = m->time,
+                         .source = m->nick, .target = IRC_PARAM(m, 0),
+                         .text = m->trailing};
 
-  LIST_FOREACH(nick_ent, &nick_list_head, entries) {
-    if (strcasecmp(nick_ent->nick, nick) == 0) {
-      LIST_REMOVE(nick_ent, entries);
-      free(nick_ent->nick);
-      free(nick_ent);
-      return 1;
-    }
+  if (history_seen(m))
+    return;
+  if (strncmp(m->trailing, "\1ACTION ", 8) == 0) {
+    ev.kind = MSG_ACTION;
+    ev.text = m->trailing + 8;
+    m->trailing[8 + strcspn(ev.text, "\1")] = '\0';
   }
-  return 0;
+  emit(&ev);
 }
 
-void remove_all_nicks() {
-  struct nick_entry *nick_ent;
-  while (!LIST_EMPTY(&nick_list_head)) {
-    nick_ent = LIST_FIRST(&nick_list_head);
-    LIST_REMOVE(nick_ent, entries);
-    free(nick_ent->nick);
-    free(nick_ent);
+static void srv_ping(struct irc_msg *m) {
+  sout_urgent("PONG :%s", m->trailing);
+}
+
+static void srv_pong(struct irc_msg *m) {
+  UNUSED(m);
+  if (stats.lag_pending) {
+    stats.lag_ms = ms_since(&stats.lag_sent);
+    stats.lag_pending = false;
   }
 }
 
-void initialize_readline() {
-  char *complete = strdup("TAB:menu-complete");
-  rl_readline_name = "ircl";
-  rl_attempted_completion_function = ircl_completion;
+static void srv_join(struct irc_msg *m) {
+  char *channel = IRC_PARAM(m, 0);
+  struct irc_channel *chan;
+  bool self = !strcmp(m->nick, default_nick);
+
+  if (self && !find_channel(channel)) /* a rejoin keeps its slot */
+    add_channel(channel);
+  emit(&(struct irc_event){.kind = MSG_JOIN, .time = m->time,
+                           .source = m->nick, .target = channel,
+                           .muted = !self && !nick_is_active(m->nick)});
+  if (!(chan = find_channel(channel)))
+    return;
+  add_member(chan, m->nick, 0);
+  if (self) {
+    chan->live_ms = m->ms;
+    chan->history_pages = 0;
+    chan->history_lines = 0;
+    /* only a rejoin: fetch what went by while we were gone */
+    if ((ircv3.caps & CAP_HISTORY) == CAP_HISTORY && chan->last_ms)
+      history_request(chan, chan->last_ms);
+  }
+}
 
-  /* don't display matches, just complete them in place */
-  rl_parse_and_bind(complete); /* can't supply a string literal here */
-  free(complete);
+/* we are no longer in channel, by PART or KICK */
+static void left_channel(const char *channel) {
+  remove_channel(channel);
+  if (!irc_strcasecmp(channel, default_channel)) {
+    strlcpy(default_channel, IRCL_CHANNEL_NAME, sizeof default_channel);
+    update_prompt(default_channel);
+  }
+}
 
-  /* remove '@&' from defaults */
-  rl_completer_word_break_characters = " \t\n\"\\'`$><=;|{(";
-  rl_callback_handler_install("> ", (rl_vcpfunc_t *)&readline_nonblocking_cb);
-  if (rl_bind_key(RETURN, handle_return_cb)) {
-    eprint("failed to bind RETURN key");
+static void srv_part(struct irc_msg *m) {
+  char *channel = IRC_PARAM(m, 0);
+  bool self = !strcmp(m->nick, default_nick);
+
+  emit(&(struct irc_event){.kind = MSG_PART, .time = m->time,
+                           .source = m->nick, .target = channel,
+                           .text = m->nparams > 1 ? m->trailing : "",
+                           .muted = !self && !nick_is_active(m->nick)});
+  if (self) {
+    left_channel(channel);
+    return;
   }
-  load_usernames_file();
+  if (!remove_member(find_channel(channel), m->nick))
+    remove_nick(m->nick); /* no channels left in common */
 }
 
-int handle_return_cb() {
-  char *line = NULL, *ln = NULL;
-  int i = 0, prompt_len = 0;
+static void srv_kick(struct irc_msg *m) {
+  char *channel = IRC_PARAM(m, 0), *victim = IRC_PARAM(m, 1);
+  bool self = !strcmp(victim, default_nick);
+
+  emit(&(struct irc_event){.kind = MSG_KICK, .time = m->time,
+                           .source = m->nick, .target = channel,
+                           .arg = victim,
+                           .text = m->nparams > 2 ? m->trailing : "",
+                           .muted = !self && !nick_is_active(victim) &&
+                                    !nick_is_active(m->nick)});
+  if (self) {
+    left_channel(channel);
+    return;
+  }
+  if (!remove_member(find_channel(channel), victim))
+    remove_nick(victim);
+}
 
-  rl_done = 1;
+static void srv_quit(struct irc_msg *m) {
+  emit(&(struct irc_event){.kind = MSG_QUIT, .time = m->time,
+                           .source = m->nick, .text = m->trailing,
+                           .muted = !nick_is_active(m->nick)});
+  remove_nick(m->nick); /* and every channel membership with it */
+}
 
-  ln = rl_copy_text(0, rl_end);
-  line = stripwhite(ln);
-  rl_replace_line("", 1);
+static void srv_nick(struct irc_msg *m) {
+  char *nick = IRC_PARAM(m, 0);
 
-  if (line && *line) {
-    add_history(line);
+  emit(&(struct irc_event){.kind = MSG_NICK, .time = m->time,
+                           .source = m->nick, .text = nick});
+  rename_nick(m->nick, nick);
+  if (strcmp(m->nick, default_nick) == 0) {
+    strlcpy(default_nick, nick, sizeof default_nick);
+    highlight_build();
   }
+}
 
-  parsein(line);
-  free(ln);
+static void srv_notice(struct irc_msg *m) {
+  if (history_seen(m))
+    return;
+  emit(&(struct irc_event){.kind = MSG_NOTICE, .time = m->time,
+                           .source = m->nick, .target = IRC_PARAM(m, 0),
+                           .text = m->trailing});
+}
 
-  /* erase prior prompt */
-  prompt_len = strlen(rl_prompt);
-  if (prompt_len != previous_prompt_len) {
-    previous_prompt_len = prompt_len;
-    prompt_len = get_cursor_pos(fileno(stdin), fileno(stdout)) - 1;
-  }
-  for (i = 0; i < prompt_len; i++) {
-    fprintf(rl_outstream, "\b \b");
+/* apply a mode string to a channel's simple flags; the list and member
+ * modes (bans, ops, voices ...) aren't kept */
+static void apply_modes(struct irc_channel *chan, const char *modes) {
+  char *p;
+  bool add = true;
+  size_t len;
+
+  for (; *modes; modes++) {
+    if (*modes == '+' || *modes == '-') {
+      add = *modes == '+';
+      continue;
+    }
+    if (strchr("ovhaqbeI", *modes))
+      continue;
+    p = strchr(chan->modes, *modes);
+    len = strlen(chan->modes);
+    if (add && !p && len + 2 < sizeof chan->modes) {
+      if (len == 0)
+        chan->modes[len++] = '+';
+      chan->modes[len++] = *modes;
+      chan->modes[len] = '\0';
+    } else if (!add && p) {
+      memmove(p, p + 1, strlen(p));
+      if (!strcmp(chan->modes, "+"))
+        chan->modes[0] = '\0';
+    }
   }
-  rl_redisplay();
-  return 0;
 }
 
-static int get_cursor_pos(int input_fd, int output_fd) {
-  char buf[32];
-  int escape = 27, cols, rows;
-  unsigned int i = 0;
+static void srv_mode(struct irc_msg *m) {
+  struct irc_channel *chan;
 
-  if (write(output_fd, "\x1b[6n", 4) != 4)
-    return -1;
+  /* <channel> <modes> [params]; user modes are eaten */
+  if (m->nparams > 1 && (chan = find_channel(IRC_PARAM(m, 0))))
+    apply_modes(chan, IRC_PARAM(m, 1));
+}
 
-  while (i < sizeof(buf) - 1) {
-    if (read(input_fd, buf + i, 1) != 1)
-      break;
-    if (buf[i] == 'R')
-      break;
-    i++;
-  }
-  buf[i] = '\0';
+static void srv_topic(struct irc_msg *m) {
+  struct irc_channel *chan;
 
-  if (buf[0] != escape || buf[1] != '[')
-    return -1;
-  if (sscanf(buf + 2, "%d;%d", &rows, &cols) != 2)
-    return -1;
-  return cols;
+  if ((chan = find_channel(IRC_PARAM(m, 0))))
+    strlcpy(chan->topic, m->trailing, sizeof chan->topic);
+  emit(&(struct irc_event){.kind = MSG_TOPIC, .time = m->time,
+                           .source = m->nick, .target = IRC_PARAM(m, 0),
+                           .text = m->trailing});
 }
 
-void readline_nonblocking_cb(char *line) {
-  /* This is a false callback. The real action is in handle_return_cb(). */
-  if (NULL == line) {
-    eprint("ircl: broken pipe\n");
-    return;
+static const struct {
+  const char *name;
+  enum cap_flag flag;
+} cap_map[] = {
+    {"batch", CAP_BATCH},
+    {"server-time", CAP_SERVER_TIME},
+    {"message-tags", CAP_MESSAGE_TAGS},
+    {"draft/chathistory", CAP_CHATHISTORY},
+    {NULL, 0} /* sentinel */
+};
+
+static enum cap_flag cap_flag(const char *name) {
+  int i;
+
+  for (i = 0; cap_map[i].name; i++) {
+    if (!strcmp(cap_map[i].name, name))
+      return cap_map[i].flag;
   }
-  free(line);
+  return 0;
 }
 
-char **ircl_completion(const char *text, int start, int end) {
+/* CAP LS (maybe over several lines), ACK, NAK, NEW and DEL. Negotiation
+ * lines bypass flood control so registration doesn't wait on them. */
+static void srv_cap(struct irc_msg *m) {
+  const char *sub = IRC_PARAM(m, 1);
+  bool more = m->nparams > 3 && !strcmp(IRC_PARAM(m, 2), "*");
+  bool registering = conn == CONN_REGISTERING;
+  char *name;
+  size_t len;
+
+  if (!strcmp(sub, "LS") || !strcmp(sub, "NEW")) {
+    for (name = strtok(m->trailing, " "); name; name = strtok(NULL, " ")) {
+      name[strcspn(name, "=")] = '\0'; /* values don't matter to us */
+      len = strlen(ircv3.want);
+      if (cap_flag(name) && len + strlen(name) + 2 < sizeof ircv3.want)
+        snprintf(ircv3.want + len, sizeof ircv3.want - len, "%s%s",
+                 len ? " " : "", name);
+    }
+    if (more)
+      return;
+    if (ircv3.want[0])
+      sout_urgent("CAP REQ :%s", ircv3.want);
+    else if (registering)
+      sout_urgent("CAP END");
+    ircv3.want[0] = '\0';
+  } else if (!strcmp(sub, "ACK")) {
+    pout(m->nick, "> capabilities: %s", m->trailing);
+    for (name = strtok(m->trailing, " "); name; name = strtok(NULL, " ")) {
+      if (name[0] == '-')
+        ircv3.caps &= ~cap_flag(name + 1);
+      else
+        ircv3.caps |= cap_flag(name);
+    }
+    if (registering)
+      sout_urgent("CAP END");
+  } else if (!strcmp(sub, "NAK")) {
+    if (registering)
+      sout_urgent("CAP END");
+  } else if (!strcmp(sub, "DEL")) {
+    for (name = strtok(m->trailing, " "); name; name = strtok(NULL, " "))
+      ircv3.caps &= ~cap_flag(name);
+  }
+}
+
+/* BATCH +ref type [params] opens a batch, BATCH -ref closes it. History
+ * is drawn in one go when its batch closes, and the next page of it is
+ * asked for while whole pages keep coming. */
+static void srv_batch(struct irc_msg *m) {
+  const char *ref = IRC_PARAM(m, 0), *type = IRC_PARAM(m, 1);
+  struct irc_batch *b;
+  struct irc_channel *chan;
+
+  if (ref[0] == '+' && ircv3.nbatches < BATCH_MAX) {
+    b = &ircv3.batches[ircv3.nbatches++];
+    memset(b, 0, sizeof *b);
+    strlcpy(b->ref, ref + 1, sizeof b->ref);
+    strlcpy(b->target, IRC_PARAM(m, 2), sizeof b->target);
+    b->history = !strcmp(type, "chathistory") ||
+                 !strcmp(type, "draft/chathistory");
+    if (b->history)
+      render.hold++;
+    return;
+  }
+  if (ref[0] != '-' || !(b = find_batch(ref + 1)))
+    return;
+  if (b->history) {
+    render.hold--;
+    chan = find_channel(b->target);
+    if (chan && b->lines >= history_limit() &&
+        chan->history_pages < HISTORY_PAGES)
+      history_request(chan, b->last_ms);
+    else if (chan && chan->history_lines)
+      pout(chan->name, "> %lu lines of history", chan->history_lines);
+    render_flush();
+  }
+  *b = ircv3.batches[--ircv3.nbatches];
+}
+
+static void srv_default(struct irc_msg *m) {
+  char par[512];
+
+  pout(m->nick, ">< %s (%s): %s", m->cmd,
+       middle_params(m, 0, par, sizeof par), m->trailing);
+}
+
+static void rpl_welcome(struct irc_msg *m) {
+  /* welcome message, make sure correct nick is stored. */
+  char *nick = IRC_PARAM(m, 0);
+
+  strlcpy(default_nick, nick, sizeof default_nick);
+  highlight_build();
+  pout(m->nick, "> is now known as " COLOR_CHANNEL "%s" COLOR_RESET, nick);
+  insert_nick(nick);
+  conn = CONN_ONLINE;
+  reconnects = 0;
+  rejoin_channels();
+}
+
+/* 005: only CHATHISTORY=<limit> is of interest */
+static void rpl_isupport(struct irc_msg *m) {
+  int i;
+
+  for (i = 1; i < m->nparams - 1; i++) {
+    if (!strncmp(m->params[i], "CHATHISTORY=", 12))
+      ircv3.history_max = atoi(m->params[i] + 12);
+  }
+  srv_default(m);
+}
+
+static void rpl_topic(struct irc_msg *m) {
+  struct irc_channel *chan;
+
+  if ((chan = find_channel(IRC_PARAM(m, 1))))
+    strlcpy(chan->topic, m->trailing, sizeof chan->topic);
+  emit(&(struct irc_event){.kind = MSG_TOPIC, .time = m->time,
+                           .source = m->nick, .target = IRC_PARAM(m, 1),
+                           .text = m->trailing});
+}
+
+static void rpl_channelmodeis(struct irc_msg *m) {
+  struct irc_channel *chan;
+
+  /* <me> <channel> <modes> [params] */
+  if ((chan = find_channel(IRC_PARAM(m, 1)))) {
+    chan->modes[0] = '\0';
+    apply_modes(chan, IRC_PARAM(m, 2));
+  }
+  srv_default(m);
+}
+
+static void rpl_whoreply(struct irc_msg *m) {
+  /* <me> <channel> <user> <host> <server> <nick> <flags> :<hops> <name> */
+  const char *nick = IRC_PARAM(m, 5), *flags = IRC_PARAM(m, 6), *name, *p;
+  struct irc_channel *chan;
+  struct nick_entry *nick_ent;
+  char userhost[IRC_LINE_MAX];
+
+  if ((chan = find_channel(IRC_PARAM(m, 1)))) {
+    p = flags[0] ? strpbrk(flags + 1, "~&@%+") : NULL;
+    add_member(chan, nick, p ? *p : 0);
+  }
+  if ((nick_ent = find_nick(nick)))
+    nick_ent->away = flags[0] == 'G';
+  if (!listing_begin(&who_list, NULL))
+    return;
+  name = (p = strchr(m->trailing, ' ')) ? p + 1 : "";
+  snprintf(userhost, sizeof userhost, "%s@%s", IRC_PARAM(m, 2),
+           IRC_PARAM(m, 3));
+  listing_add(&who_list, (const char *[LC_COUNT]){nick, flags, userhost,
+                                                  IRC_PARAM(m, 4), name});
+}
+
+static void rpl_endofwho(struct irc_msg *m) {
+  listing_end(&who_list, IRC_PARAM(m, 1), m->nick);
+}
+
+static void rpl_namreply(struct irc_msg *m) {
+  /* <me> <=|*|@> <channel> :[prefix]<nick> ... */
+  struct irc_channel *chan = find_channel(IRC_PARAM(m, 2));
+  char *client = strtok(m->trailing, " ");
+  char prefix[2] = {0};
+  bool keep = listing_begin(&names_list, IRC_PARAM(m, 2));
+
+  if (chan && chan->names_complete)
+    clear_members(chan); /* a fresh list, e.g. from /names */
+  while (client) {
+    prefix[0] = 0;
+    while (strchr("~&@%+", *client) && *client) {
+      /* remove @ from operators, etc. */
+      if (!prefix[0])
+        prefix[0] = *client;
+      client++;
+    }
+    if (chan)
+      add_member(chan, client, prefix[0]);
+    else
+      insert_nick(client);
+    if (keep)
+      listing_add(&names_list, (const char *[LC_COUNT]){client, prefix});
+    client = strtok(NULL, " ");
+  }
+}
+
+static void rpl_endofnames(struct irc_msg *m) {
+  struct irc_channel *chan = find_channel(IRC_PARAM(m, 1));
+
+  if (chan)
+    chan->names_complete = true;
+  listing_end(&names_list, IRC_PARAM(m, 1), m->nick);
+}
+
+static void rpl_nowaway(struct irc_msg *m) {
+  is_away = 1;
+  update_prompt(default_channel);
+  pout(m->nick, "AWAY: %s", m->trailing);
+}
+
+static void rpl_unaway(struct irc_msg *m) {
+  is_away = 0;
+  update_prompt(default_channel);
+  pout(m->nick, "BACK: %s", m->trailing);
+}
+
+/* verbs are found through a perfect hash over the first two characters and
+ * the length; numerics index numeric_map directly */
+static const struct srv_handler verb_map[] = {
+    {"PRIVMSG", srv_privmsg},
+    {"PING", srv_ping},
+    {"PONG", srv_pong},
+    {"JOIN", srv_join},
+    {"PART", srv_part},
+    {"QUIT", srv_quit},
+    {"NICK", srv_nick},
+    {"NOTICE", srv_notice},
+    {"MODE", srv_mode},
+    {"TOPIC", srv_topic},
+    {"CAP", srv_cap},
+    {"BATCH", srv_batch},
+    {"KICK", srv_kick},
+    {NULL, 0} /* sentinel */
+};
+static const struct srv_handler *verb_table[VERB_TABLE_SIZE];
+static const srv_func numeric_map[1000] = {
+    [1] = rpl_welcome,
+    [5] = rpl_isupport,
+    [305] = rpl_unaway,
+    [306] = rpl_nowaway,
+    [315] = rpl_endofwho,
+    [324] = rpl_channelmodeis,
+    [332] = rpl_topic,
+    [352] = rpl_whoreply,
+    [353] = rpl_namreply,
+    [366] = rpl_endofnames,
+};
+
+static unsigned verb_hash(const char *cmd, size_t len) {
+  return ((cmd[0] * 11) ^ (cmd[1] * 31) ^ len) & (VERB_TABLE_SIZE - 1);
+}
+
+static void initialize_dispatch() {
+  const struct srv_handler *h;
+
+  for (h = verb_map; h->cmd; h++) {
+    unsigned slot = verb_hash(h->cmd, strlen(h->cmd));
+    assert(verb_table[slot] == NULL); /* retune verb_hash() if this fires */
+    verb_table[slot] = h;
+  }
+}
+
+static srv_func lookup_handler(const char *cmd) {
+  const struct srv_handler *h;
+  size_t len;
+
+  if (isdigit((unsigned char)cmd[0]) && isdigit((unsigned char)cmd[1]) &&
+      isdigit((unsigned char)cmd[2]) && !cmd[3])
+    return numeric_map[(cmd[0] - '0') * 100 + (cmd[1] - '0') * 10 +
+                       (cmd[2] - '0')];
+  len = strlen(cmd);
+  h = verb_table[verb_hash(cmd, len)];
+  if (h && !strcmp(h->cmd, cmd))
+    return h->func_ptr;
+  return NULL;
+}
+
+static void parsesrv(char *line) {
+  struct irc_msg m;
+  struct timespec t0, now;
+  srv_func func;
+
+  if (!line || !*line)
+    return;
+  stats_start(&t0);
+  stats.lines_in++;
+  if (parse_irc_msg(line, &m)) {
+    clock_gettime(CLOCK_REALTIME, &now);
+    m.time = now.tv_sec;
+    m.ms = now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+    m.batch = NULL;
+    parse_tags(&m);
+    if (m.batch && m.batch->history) {
+      m.batch->lines++;
+      m.batch->last_ms = MAX(m.batch->last_ms, m.ms);
+    }
+    func = lookup_handler(m.cmd);
+    (func ? func : srv_default)(&m);
+  }
+  arena_reset();
+  stats_stop(ST_PARSESRV, &t0);
+}
+
+/* one read from the server into the free tail of rbuf: > 0 bytes read, 0 on
+ * EOF, -1 on error */
+static int recv_fill() {
+  struct timespec t0;
+  size_t room;
+  int n;
+
+  if (rbuf.start == rbuf.end) {
+    rbuf.start = rbuf.end = rbuf.scan = 0;
+  } else if (rbuf.end == RECV_BUF_SIZE && rbuf.start > 0) {
+    /* move the partial line down to make room */
+    memmove(rbuf.buf, rbuf.buf + rbuf.start, rbuf.end - rbuf.start);
+    rbuf.end -= rbuf.start;
+    rbuf.scan -= rbuf.start;
+    rbuf.start = 0;
+  }
+  room = RECV_BUF_SIZE - rbuf.end;
+  if (use_ssl) {
+    stats_start(&t0);
+    n = SSL_read(ssl, rbuf.buf + rbuf.end, room);
+    stats_stop(ST_SSL_READ, &t0);
+    if (n <= 0) {
+      switch (SSL_get_error(ssl, n)) {
+      case SSL_ERROR_WANT_READ:
+      case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+      case SSL_ERROR_ZERO_RETURN:
+        return 0;
+      default:
+        return -1;
+      }
+    }
+  } else {
+    do {
+      n = read(srv, rbuf.buf + rbuf.end, room);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0)
+      return n;
+  }
+  rbuf.end += n;
+  stats.bytes_in += n;
+  return n;
+}
+
+/* hand every complete CR and/or LF terminated line to parsesrv() */
+static void recv_frame() {
+  char *p, *line;
+
+  for (;;) {
+    p = rbuf.buf + rbuf.scan;
+    while (p < rbuf.buf + rbuf.end && *p != '\r' && *p != '\n')
+      p++;
+    if (p == rbuf.buf + rbuf.end) {
+      if (rbuf.start == 0 && rbuf.end == RECV_BUF_SIZE) {
+        /* no terminator in a full buffer: cut the line here */
+        rbuf.dropped++;
+      } else {
+        rbuf.scan = rbuf.end;
+        return;
+      }
+    }
+    *p = '\0';
+    line = rbuf.buf + rbuf.start;
+    rbuf.start = rbuf.scan = p - rbuf.buf + 1;
+    if (*line)
+      parsesrv(line); /* \r\n leaves an empty line behind; skip it */
+    if (rbuf.start >= rbuf.end) {
+      rbuf.start = rbuf.end = rbuf.scan = 0;
+      return;
+    }
+  }
+}
+
+static void update_active_nicks(const char *nick) {
+  /* Maintain a queue of the 10 most recent nicks to say something.
+   * Then mute everyone else's join/part activity. */
+  int i;
+  static int next_available = 0;
+
+  for (i = 0; i < ACTIVE_NICKS_QUEUE_SIZE; i++) {
+    if (strcasecmp(active_nicks[i], nick) == 0) {
+      /* already in active queue, so skip */
+      return;
+    }
+  }
+  strlcpy(active_nicks[next_available], nick, NICK_NAME_MAX);
+  next_available = (next_available + 1) % ACTIVE_NICKS_QUEUE_SIZE;
+}
+
+static int nick_is_active(const char *nick) {
+  int i;
+
+  for (i = 0; i < ACTIVE_NICKS_QUEUE_SIZE; i++) {
+    if (active_nicks[i][0] && (strcasecmp(active_nicks[i], nick) == 0)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void login() {
+  conn = CONN_CONNECTING;
+  rbuf.start = rbuf.end = rbuf.scan = 0; /* drop any stale partial line */
+  sendq.count = sendq.off = 0;
+  sendq.retry = false;
+  dial(host, port);
+}
+
+/* the dialer won a connection (already non-blocking) */
+static void login_connected(int i) {
+  srv = i;
+  ev_io_add(srv, EV_READ, srv_ready);
+  clock_gettime(CLOCK_MONOTONIC, &trespond);
+  pinged = false;
+  ev_timer_arm(&ping_timer, (use_ssl ? DIAL_TIMEOUT_SECS : KEEPALIVE_SECS) * 1000);
+  if (use_ssl)
+    ssl_connect(i, host);
+  else
+    register_nick();
+}
+
+static void register_nick() {
+  conn = CONN_REGISTERING;
+  /* a new connection starts with the server's full flood allowance */
+  clock_gettime(CLOCK_MONOTONIC, &sendq.refilled);
+  sendq.budget_ms = FLOOD_BURST * FLOOD_INTERVAL_MS;
+  ircv3.caps = 0;
+  ircv3.want[0] = '\0';
+  sout_urgent("CAP LS 302");
+  if (password)
+    sout("PASS %s", password);
+  sout("NICK %s", default_nick);
+  sout("USER %s localhost %s :%s", default_nick, host, default_nick);
+  if (!*default_channel)
+    set_default_channel();
+  else
+    update_prompt(default_channel);
+}
+
+/* back on after 001: JOIN every channel we were in, as few lines as fit */
+static void rejoin_channels() {
+  char line[IRC_LINE_MAX - 2];
+  struct irc_channel *chan;
+  const char *name;
+  int len = 0;
+
+  TAILQ_FOREACH(chan, &channels.order, joined) {
+    name = chan->name;
+    if (!strchr("#&+!", name[0]))
+      continue;
+    if (len && len + strlen(name) + 1 >= sizeof line) {
+      sout("%s", line);
+      len = 0;
+    }
+    len += snprintf(line + len, sizeof line - len, "%s%s",
+                    len ? "," : "JOIN ", name);
+  }
+  if (len)
+    sout("%s", line);
+}
+
+/* RFC 1459 case mapping: A-Z and []\~ fold to a-z and {}|^ */
+static void initialize_casemap() {
+  int c;
+
+  for (c = 0; c < 256; c++)
+    casemap[c] = tolower(c);
+  casemap['['] = '{';
+  casemap[']'] = '}';
+  casemap['\\'] = '|';
+  casemap['~'] = '^';
+}
+
+static int irc_strcasecmp(const char *a, const char *b) {
+  const unsigned char *s1 = (const unsigned char *)a;
+  const unsigned char *s2 = (const unsigned char *)b;
+
+  while (casemap[*s1] == casemap[*s2]) {
+    if (*s1 == '\0')
+      return 0;
+    s1++;
+    s2++;
+  }
+  return casemap[*s1] - casemap[*s2];
+}
+
+/* FNV-1a over the case-mapped name */
+static unsigned long irc_hash(const char *s) {
+  unsigned long h = 2166136261UL;
+
+  while (*s) {
+    h ^= casemap[(unsigned char)*s++];
+    h *= 16777619UL;
+  }
+  return h;
+}
+
+/* completion keys ignore one leading '#', '&' or '@' and compare with the
+ * RFC 1459 case mapping */
+static const char *prefix_key(const char *name) {
+  return starts_with_symbol(name) ? name + 1 : name;
+}
+
+/* compare the first len characters of name's key against prefix */
+static int prefix_ncmp(const char *name, const char *prefix, size_t len) {
+  const unsigned char *s1 = (const unsigned char *)prefix_key(name);
+  const unsigned char *s2 = (const unsigned char *)prefix;
+
+  for (; len > 0; len--, s1++, s2++) {
+    if (casemap[*s1] != casemap[*s2])
+      return casemap[*s1] - casemap[*s2];
+    if (*s1 == '\0')
+      return 0;
+  }
+  return 0;
+}
+
+/* first slot whose key is not below prefix */
+static size_t prefix_lower_bound(const struct prefix_index *ix,
+                                 const char *prefix, size_t len) {
+  size_t lo = 0, hi = ix->count, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (prefix_ncmp(ix->names[mid], prefix, len) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* [*lo, *hi) are all the names whose key starts with prefix */
+static void prefix_range(const struct prefix_index *ix, const char *prefix,
+                         size_t *lo, size_t *hi) {
+  size_t len = strlen(prefix), l, h, mid;
+
+  *lo = l = prefix_lower_bound(ix, prefix, len);
+  h = ix->count;
+  while (l < h) {
+    mid = l + (h - l) / 2;
+    if (prefix_ncmp(ix->names[mid], prefix, len) <= 0)
+      l = mid + 1;
+    else
+      h = mid;
+  }
+  *hi = l;
+}
+
+static void prefix_insert(struct prefix_index *ix, const char *name) {
+  size_t at;
+
+  if (ix->count == ix->size) {
+    size_t size = ix->size ? ix->size * 2 : 256;
+    const char **names = realloc(ix->names, size * sizeof(char *));
+    if (!names)
+      eprint("ircl: unable to grow completion index:");
+    ix->names = names;
+    ix->size = size;
+  }
+  at = prefix_lower_bound(ix, prefix_key(name), SIZE_MAX);
+  memmove(ix->names + at + 1, ix->names + at,
+          (ix->count - at) * sizeof(char *));
+  ix->names[at] = name;
+  ix->count++;
+}
+
+static void prefix_remove(struct prefix_index *ix, const char *name) {
+  size_t at = prefix_lower_bound(ix, prefix_key(name), SIZE_MAX);
+
+  /* equal keys ("#foo" and "foo") sit together; find this very string */
+  while (at < ix->count && ix->names[at] != name &&
+         !prefix_ncmp(ix->names[at], prefix_key(name), SIZE_MAX))
+    at++;
+  if (at == ix->count || ix->names[at] != name)
+    return;
+  memmove(ix->names + at, ix->names + at + 1,
+          (ix->count - at - 1) * sizeof(char *));
+  ix->count--;
+}
+
+/* collect the COMPLETION_MAX most recently seen names in [lo, hi),
+ * newest first. keep() filters candidates; seen() ranks them. */
+static void prefix_best(const struct prefix_index *ix, size_t lo, size_t hi,
+                        bool (*keep)(const char *),
+                        unsigned long (*seen)(const char *),
+                        struct completion *c) {
+  unsigned long stamp[COMPLETION_MAX];
+  unsigned long s;
+  size_t i;
+  int j;
+
+  c->count = c->next = 0;
+  for (i = lo; i < hi; i++) {
+    if (keep && !keep(ix->names[i]))
+      continue;
+    s = seen ? seen(ix->names[i]) : 0;
+    if (c->count == COMPLETION_MAX && s <= stamp[COMPLETION_MAX - 1])
+      continue;
+    j = c->count < COMPLETION_MAX ? c->count++ : COMPLETION_MAX - 1;
+    for (; j > 0 && stamp[j - 1] < s; j--) {
+      stamp[j] = stamp[j - 1];
+      c->names[j] = c->names[j - 1];
+    }
+    stamp[j] = s;
+    c->names[j] = ix->names[i];
+  }
+}
+
+void initialize_nicks() {
+  size_t n = 1;
+
+  while (n < nicks.capacity)
+    n <<= 1;
+  nicks.nbuckets = n;
+  nicks.buckets = calloc(n, sizeof(*nicks.buckets));
+  if (!nicks.buckets)
+    eprint("ircl: unable to allocate nick registry:");
+  TAILQ_INIT(&nicks.mru);
+  LIST_INIT(&nicks.free);
+  nicks.count = 0;
+}
+
+struct nick_entry *find_nick(const char *nick) {
+  struct nick_entry *nick_ent;
+
+  LIST_FOREACH(nick_ent, NICK_BUCKET(nick), hash) {
+    if (irc_strcasecmp(nick_ent->nick, nick) == 0)
+      return nick_ent;
+  }
+  return NULL;
+}
+
+/* take an entry off the free list, carving a new slab or evicting the least
+ * recently used nick when needed */
+static struct nick_entry *alloc_nick() {
+  struct nick_entry *nick_ent;
+  int i;
+
+  if (nicks.count >= nicks.capacity) {
+    nick_ent = TAILQ_LAST(&nicks.mru, nick_mru);
+    drop_memberships(nick_ent);
+    prefix_remove(&nicks.index, nick_ent->nick);
+    TAILQ_REMOVE(&nicks.mru, nick_ent, mru);
+    LIST_REMOVE(nick_ent, hash);
+    nicks.count--;
+    return nick_ent;
+  }
+  if (LIST_EMPTY(&nicks.free)) {
+    nick_ent = calloc(NICK_SLAB, sizeof(struct nick_entry));
+    if (!nick_ent)
+      eprint("ircl: unable to grow nick registry:");
+    for (i = 0; i < NICK_SLAB; i++)
+      LIST_INSERT_HEAD(&nicks.free, &nick_ent[i], hash);
+  }
+  nick_ent = LIST_FIRST(&nicks.free);
+  LIST_REMOVE(nick_ent, hash);
+  return nick_ent;
+}
+
+/* add a nick, or move it to the front of the completion order */
+static struct nick_entry *touch_nick(const char *nick) {
+  struct nick_entry *nick_ent;
+
+  if (strlen(nick) >= NICK_NAME_MAX)
+    return NULL;
+  if ((nick_ent = find_nick(nick))) {
+    TAILQ_REMOVE(&nicks.mru, nick_ent, mru);
+    TAILQ_INSERT_HEAD(&nicks.mru, nick_ent, mru);
+    strlcpy(nick_ent->nick, nick, sizeof nick_ent->nick); /* case changes */
+    nick_ent->seen = ++nicks.clock;
+    return nick_ent;
+  }
+  nick_ent = alloc_nick();
+  strlcpy(nick_ent->nick, nick, sizeof nick_ent->nick);
+  nick_ent->seen = ++nicks.clock;
+  nick_ent->away = false;
+  LIST_INIT(&nick_ent->channels);
+  prefix_insert(&nicks.index, nick_ent->nick);
+  LIST_INSERT_HEAD(NICK_BUCKET(nick), nick_ent, hash);
+  TAILQ_INSERT_HEAD(&nicks.mru, nick_ent, mru);
+  nicks.count++;
+  return nick_ent;
+}
+
+int insert_nick(const char *nick) { return touch_nick(nick) != NULL; }
+
+static void free_nick(struct nick_entry *nick_ent) {
+  drop_memberships(nick_ent);
+  prefix_remove(&nicks.index, nick_ent->nick);
+  LIST_REMOVE(nick_ent, hash);
+  TAILQ_REMOVE(&nicks.mru, nick_ent, mru);
+  LIST_INSERT_HEAD(&nicks.free, nick_ent, hash);
+  nicks.count--;
+}
+
+int remove_nick(const char *nick) {
+  struct nick_entry *nick_ent;
+
+  if (!(nick_ent = find_nick(nick)))
+    return 0;
+  free_nick(nick_ent);
+  return 1;
+}
+
+/* rehash a nick under its new name, keeping its channels and recency */
+static void rename_nick(const char *from, const char *to) {
+  struct nick_entry *nick_ent, *other;
+
+  if (!(nick_ent = find_nick(from)) || strlen(to) >= NICK_NAME_MAX) {
+    remove_nick(from);
+    insert_nick(to);
+    return;
+  }
+  if ((other = find_nick(to)) && other != nick_ent)
+    free_nick(other);
+  LIST_REMOVE(nick_ent, hash);
+  prefix_remove(&nicks.index, nick_ent->nick);
+  strlcpy(nick_ent->nick, to, sizeof nick_ent->nick);
+  LIST_INSERT_HEAD(NICK_BUCKET(to), nick_ent, hash);
+  prefix_insert(&nicks.index, nick_ent->nick);
+  nick_ent->seen = ++nicks.clock;
+  TAILQ_REMOVE(&nicks.mru, nick_ent, mru);
+  TAILQ_INSERT_HEAD(&nicks.mru, nick_ent, mru);
+}
+
+void remove_all_nicks() {
+  struct nick_entry *nick_ent;
+
+  nicks.index.count = 0; /* cheaper than removing one by one */
+  while ((nick_ent = TAILQ_FIRST(&nicks.mru)))
+    free_nick(nick_ent);
+}
+
+/* channel membership: each membership is linked into both its channel's
+ * member list and its nick's channel list, so a QUIT touches only the
+ * channels that nick was in */
+static struct membership *find_member(struct irc_channel *chan,
+                                      struct nick_entry *nick_ent) {
+  struct membership *mb;
+
+  LIST_FOREACH(mb, &nick_ent->channels, by_nick) {
+    if (mb->chan == chan)
+      return mb;
+  }
+  return NULL;
+}
+
+static void add_member(struct irc_channel *chan, const char *nick,
+                       char prefix) {
+  struct nick_entry *nick_ent;
+  struct membership *mb;
+  int i;
+
+  /* a NAMES burst shouldn't reorder nicks people are talking to */
+  if (!(nick_ent = find_nick(nick)) && !(nick_ent = touch_nick(nick)))
+    return;
+  if ((mb = find_member(chan, nick_ent))) {
+    mb->prefix = prefix;
+    return;
+  }
+  if (LIST_EMPTY(&free_members)) {
+    mb = calloc(MEMBER_SLAB, sizeof(struct membership));
+    if (!mb)
+      eprint("ircl: unable to grow channel members:");
+    for (i = 0; i < MEMBER_SLAB; i++)
+      LIST_INSERT_HEAD(&free_members, &mb[i], by_chan);
+  }
+  mb = LIST_FIRST(&free_members);
+  LIST_REMOVE(mb, by_chan);
+  mb->chan = chan;
+  mb->nick = nick_ent;
+  mb->prefix = prefix;
+  LIST_INSERT_HEAD(&chan->members, mb, by_chan);
+  LIST_INSERT_HEAD(&nick_ent->channels, mb, by_nick);
+  chan->nmembers++;
+}
+
+static void free_member(struct membership *mb) {
+  LIST_REMOVE(mb, by_chan);
+  LIST_REMOVE(mb, by_nick);
+  mb->chan->nmembers--;
+  LIST_INSERT_HEAD(&free_members, mb, by_chan);
+}
+
+/* returns true if the nick is still in some other channel with us */
+static bool remove_member(struct irc_channel *chan, const char *nick) {
+  struct nick_entry *nick_ent;
+  struct membership *mb;
+
+  if (!(nick_ent = find_nick(nick)))
+    return false;
+  if (chan && (mb = find_member(chan, nick_ent)))
+    free_member(mb);
+  return !LIST_EMPTY(&nick_ent->channels);
+}
+
+static void drop_memberships(struct nick_entry *nick_ent) {
+  while (!LIST_EMPTY(&nick_ent->channels))
+    free_member(LIST_FIRST(&nick_ent->channels));
+}
+
+static void clear_members(struct irc_channel *chan) {
+  while (!LIST_EMPTY(&chan->members))
+    free_member(LIST_FIRST(&chan->members));
+  chan->names_complete = false;
+}
+
+static bool nick_in_channel(const struct nick_entry *nick_ent,
+                            const struct irc_channel *chan) {
+  struct membership *mb;
+
+  LIST_FOREACH(mb, &nick_ent->channels, by_nick) {
+    if (mb->chan == chan)
+      return true;
+  }
+  return false;
+}
+
+void initialize_readline() {
+  char *complete = strdup("TAB:menu-complete");
+  rl_readline_name = "ircl";
+  rl_attempted_completion_function = ircl_completion;
+
+  /* don't display matches, just complete them in place */
+  rl_parse_and_bind(complete); /* can't supply a string literal here */
+  free(complete);
+
+  /* remove '@&' from defaults */
+  rl_completer_word_break_characters = " \t\n\"\\'`$><=;|{(";
+  rl_callback_handler_install("> ", (rl_vcpfunc_t *)&readline_nonblocking_cb);
+  if (rl_bind_key(RETURN, handle_return_cb)) {
+    eprint("failed to bind RETURN key");
+  }
+  load_usernames_file();
+}
+
+/* Enter: run the line with everything it prints in one render batch.
+ * The line isn't accepted the readline way, which would reset the
+ * terminal and draw the new prompt in writes of their own; readline
+ * redisplays after every key anyway, and that flush is the only write. */
+int handle_return_cb() {
+  char *line = NULL, *ln = NULL;
+
+  ln = arena_alloc(rl_end + 1);
+  memcpy(ln, rl_line_buffer, rl_end);
+  ln[rl_end] = '\0';
+  line = stripwhite(ln);
+  render_begin(); /* takes the line off screen */
+  if (where_history() < history_length)
+    rl_maybe_unsave_line(); /* drop what was typed before browsing */
+  rl_replace_line("", 1);
+
+  if (line && *line) {
+    add_history(line);
+  }
+  using_history();
+
+  parsein(line);
+  arena_reset();
+  render_end();
+  return 0;
+}
+
+void readline_nonblocking_cb(char *line) {
+  /* This is a false callback. The real action is in handle_return_cb(). */
+  if (NULL == line) {
+    eprint("ircl: broken pipe\n");
+    return;
+  }
+  free(line);
+}
+
+char **ircl_completion(const char *text, int start, int end) {
   char **matches = NULL;
   int len = strlen(text);
   UNUSED(start);
@@ -913,96 +3263,302 @@ char **ircl_completion(const char *text, int start, int end) {
   return matches;
 }
 
-static char *cmd_generator(const char *text, int state) {
-  static int list_index, len;
-  const char *name;
+static char *cmd_generator(const char *text, int state) {
+  static int list_index, len;
+  const char *name;
+
+  if (!state) {
+    list_index = 0;
+    len = strlen(text);
+  }
+
+  while ((name = command_map[list_index].long_cmd)) {
+    list_index++;
+    if (strncasecmp(name, text, len) == 0) {
+      char *cmd_name;
+      int cmd_len = 0;
+      cmd_len = strlen(name) + 2;
+      cmd_name = calloc(cmd_len, sizeof(char));
+      snprintf(cmd_name, cmd_len, "/%s", name);
+      return cmd_name;
+    }
+  }
+  return ((char *)NULL);
+}
+
+static unsigned long nick_seen(const char *name) { return NICK_OF(name)->seen; }
+
+static bool completion_keep(const char *name) {
+  if (cfilter.symbol && name[0] != cfilter.symbol)
+    return false;
+  if (cfilter.scope && !nick_in_channel(NICK_OF(name), cfilter.scope))
+    return false;
+  return true;
+}
+
+/* compare the first len characters of a user name's key against key,
+ * like prefix_ncmp(); the name isn't NUL terminated */
+static int user_ncmp(const struct user_ref *r, const char *key, size_t len) {
+  const unsigned char *s1 = (const unsigned char *)users.map + r->off;
+  const unsigned char *s2 = (const unsigned char *)key;
+  size_t n = r->len, i;
+  int c1;
+
+  if (n && starts_with_symbol((const char *)s1)) {
+    s1++;
+    n--;
+  }
+  for (i = 0; i < len; i++, s2++) {
+    c1 = i < n ? casemap[s1[i]] : 0;
+    if (c1 != casemap[*s2])
+      return c1 - casemap[*s2];
+    if (c1 == 0)
+      return 0;
+  }
+  return 0;
+}
+
+static int user_cmp(const void *a, const void *b) {
+  const struct user_ref *r = b;
+  char key[NICK_NAME_MAX * 4];
+  size_t n = r->len < sizeof key - 1 ? r->len : sizeof key - 1;
+  const char *k;
+
+  memcpy(key, users.map + r->off, n);
+  key[n] = '\0';
+  k = prefix_key(key);
+  return user_ncmp(a, k, strlen(k) + 1);
+}
+
+/* first ref whose key is not below key (upper: above it) */
+static size_t user_bound(const char *key, size_t len, bool upper) {
+  size_t lo = 0, hi = users.count, mid;
+  int r;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    r = user_ncmp(&users.refs[mid], key, len);
+    if (r < 0 || (upper && r == 0))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* map ~/.irclusers.idx if it was made from the file as it is now */
+static bool users_index_load() {
+  const struct users_index_header *h;
+  const struct user_ref *refs;
+  struct stat st;
+  size_t i;
+  void *map;
+  int fd;
+
+  if ((fd = open(users.index_path, O_RDONLY)) == -1)
+    return false;
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof *h ||
+      (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) ==
+          MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+  close(fd);
+  h = map;
+  refs = (const struct user_ref *)(h + 1);
+  if (h->magic != USERS_INDEX_MAGIC || h->version != USERS_INDEX_VERSION ||
+      h->mtime != (int64_t)users.mtime || h->size != users.size ||
+      (size_t)st.st_size != sizeof *h + h->count * sizeof *refs) {
+    munmap(map, st.st_size);
+    return false;
+  }
+  for (i = 0; i < h->count; i++) {
+    if ((size_t)refs[i].off + refs[i].len > users.size) {
+      munmap(map, st.st_size);
+      return false;
+    }
+  }
+  users.index_map = map;
+  users.index_size = st.st_size;
+  users.refs = refs;
+  users.count = h->count;
+  return true;
+}
+
+/* write the sorted refs next to the file, atomically */
+static bool users_index_save() {
+  struct users_index_header h = {.magic = USERS_INDEX_MAGIC,
+                                 .version = USERS_INDEX_VERSION,
+                                 .mtime = users.mtime,
+                                 .size = users.size,
+                                 .count = users.count};
+  char tmp[PATH_MAX + 16];
+  size_t len = users.count * sizeof *users.built;
+  int fd;
+  bool ok;
+
+  snprintf(tmp, sizeof tmp, "%s.tmp", users.index_path);
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1)
+    return false;
+  ok = write(fd, &h, sizeof h) == sizeof h &&
+       (len == 0 || write(fd, users.built, len) == (ssize_t)len);
+  close(fd);
+  if (!ok || rename(tmp, users.index_path) == -1) {
+    unlink(tmp);
+    return false;
+  }
+  return true;
+}
+
+static uint64_t user_hash(const char *p, size_t len) {
+  uint64_t h = 14695981039346656037ULL; /* FNV-1a */
 
-  if (!state) {
-    list_index = 0;
-    len = strlen(text);
+  while (len--) {
+    h ^= (unsigned char)*p++;
+    h *= 1099511628211ULL;
   }
+  return h;
+}
 
-  while ((name = command_map[list_index].long_cmd)) {
-    list_index++;
-    if (strncasecmp(name, text, len) == 0) {
-      char *cmd_name;
-      int cmd_len = 0;
-      cmd_len = strlen(name) + 2;
-      cmd_name = calloc(cmd_len, sizeof(char));
-      snprintf(cmd_name, cmd_len, "/%s", name);
-      return cmd_name;
-    }
+/* once saved, the page cache holds the index: use that copy. Hash every
+ * name now, while the mapping is known to match the index; by the time
+ * the file changes it may already show the new contents. */
+static void users_index_keep() {
+  size_t i;
+
+  if (users_index_save() && users_index_load()) {
+    free(users.built);
+    users.built = NULL;
   }
-  return ((char *)NULL);
+  free(users.hashes);
+  if (!(users.hashes = malloc((users.count + 1) * sizeof *users.hashes)))
+    eprint("ircl: malloc:");
+  for (i = 0; i < users.count; i++)
+    users.hashes[i] =
+        user_hash(users.map + users.refs[i].off, users.refs[i].len);
 }
 
-static char *username_generator(const char *text, int state) {
-  static int list_index, len;
-  const char *name;
-  int offset = 0;
+/* the first completion: use the cached index, or sort one and cache it */
+static void users_index() {
+  const char *p, *end, *nl;
+  size_t cap = 0, len;
 
-  if (!usernames) {
-    return ((char *)NULL);
+  if (users.indexed || !users.map)
+    return;
+  users.indexed = true;
+  if (users_index_load()) {
+    users_index_keep();
+    return;
   }
-
-  if (!state) {
-    list_index = 0;
-    len = strlen(text);
+  for (p = users.map, end = users.map + users.size; p < end; p = nl + 1) {
+    if (!(nl = memchr(p, '\n', end - p)))
+      nl = end;
+    len = nl - p;
+    if (len && p[len - 1] == '\r')
+      len--;
+    if (len < 2)
+      continue;
+    if (users.count == cap) {
+      cap = cap ? cap * 2 : 1024;
+      if (!(users.built = realloc(users.built, cap * sizeof *users.built)))
+        eprint("ircl: realloc:");
+    }
+    users.built[users.count++] = (struct user_ref){p - users.map, len};
   }
+  qsort(users.built, users.count, sizeof *users.built, user_cmp);
+  users.refs = users.built;
+  users_index_keep();
+}
 
-  while ((name = usernames[list_index])) {
-    offset = 0;
-    list_index++;
-    if (!starts_with_symbol(text) && starts_with_symbol(name)) {
-      offset = 1; /* skip @ in @name, etc. */
-    }
+static unsigned long user_seen(const struct user_ref *r, char *name) {
+  struct nick_entry *nick_ent;
+  size_t n = r->len < NICK_NAME_MAX - 1 ? r->len : NICK_NAME_MAX - 1;
+
+  memcpy(name, users.map + r->off, n);
+  name[n] = '\0';
+  nick_ent = find_nick(prefix_key(name));
+  return nick_ent ? nick_ent->seen : 0;
+}
+
+/* the COMPLETION_MAX best user names for text, most recently seen first,
+ * as prefix_best() does for nicks */
+static char *username_generator(const char *text, int state) {
+  static const struct user_ref *best[COMPLETION_MAX];
+  static int count, next;
+  unsigned long stamp[COMPLETION_MAX], s;
+  char name[NICK_NAME_MAX];
+  const char *key = prefix_key(text);
+  size_t lo, hi, i;
+  char symbol;
+  int j;
 
-    if (strncasecmp(name + offset, text, len) == 0) {
-      return strdup(name);
+  if (!state) {
+    count = next = 0;
+    /* the file may have been cut short in place since it was mapped:
+     * reading past its end now would raise SIGBUS */
+    users_check();
+    if (!users.map)
+      return NULL;
+    users_index();
+    symbol = starts_with_symbol(text) ? text[0] : 0;
+    lo = user_bound(key, strlen(key), false);
+    hi = user_bound(key, strlen(key), true);
+    for (i = lo; i < hi; i++) {
+      if (symbol && users.map[users.refs[i].off] != symbol)
+        continue;
+      s = user_seen(&users.refs[i], name);
+      if (count == COMPLETION_MAX && s <= stamp[COMPLETION_MAX - 1])
+        continue;
+      j = count < COMPLETION_MAX ? count++ : COMPLETION_MAX - 1;
+      for (; j > 0 && stamp[j - 1] < s; j--) {
+        stamp[j] = stamp[j - 1];
+        best[j] = best[j - 1];
+      }
+      stamp[j] = s;
+      best[j] = &users.refs[i];
     }
   }
-  return ((char *)NULL);
+  if (next == count)
+    return ((char *)NULL);
+  next++;
+  return strndup(users.map + best[next - 1]->off, best[next - 1]->len);
 }
 
 static char *nick_generator(const char *text, int state) {
-  static struct nick_entry *nick_ent;
+  static struct completion c;
   static int len = 0;
   const char *fullnick;
-  const char *name;
+  size_t lo, hi;
 
   if (!state) {
-    nick_ent = LIST_FIRST(&nick_list_head);
     len = strlen(text);
-  }
-
-  while (nick_ent != NULL) {
-    name = nick_ent->nick;
-    fullnick = name;
-    nick_ent = LIST_NEXT(nick_ent, entries);
-
-    if (name && !starts_with_symbol(text) && starts_with_symbol(name)) {
-      /* skip prefixes like @person and #jerks */
-      name++;
-    }
-
-    if (name && strncasecmp(name, text, len) == 0) {
-      if (rl_point == len) {
-        /* completing a nick at the beginning of a line, so
-         * append a colon:*/
-
-        char *nick_with_colon;
-        int sz;
-
-        sz = strlen(fullnick) + 2;
-        nick_with_colon = calloc(sz, sizeof(char));
-        snprintf(nick_with_colon, sz, "%s:", fullnick);
-        return nick_with_colon;
-      } else {
-        return strdup(fullnick);
-      }
+    cfilter.symbol = starts_with_symbol(text) ? text[0] : 0;
+    /* inside a channel, complete its members; fall back to everyone */
+    cfilter.scope = cfilter.symbol ? NULL : find_channel(default_channel);
+    prefix_range(&nicks.index, prefix_key(text), &lo, &hi);
+    prefix_best(&nicks.index, lo, hi, completion_keep, nick_seen, &c);
+    if (c.count == 0 && cfilter.scope) {
+      cfilter.scope = NULL;
+      prefix_best(&nicks.index, lo, hi, completion_keep, nick_seen, &c);
     }
   }
-  return ((char *)NULL);
+  if (c.next == c.count) {
+    return ((char *)NULL);
+  }
+  fullnick = c.names[c.next++];
+  if (rl_point == len) {
+    /* completing a nick at the beginning of a line, so
+     * append a colon:*/
+
+    char *nick_with_colon;
+    int sz;
+
+    sz = strlen(fullnick) + 2;
+    nick_with_colon = calloc(sz, sizeof(char));
+    snprintf(nick_with_colon, sz, "%s:", fullnick);
+    return nick_with_colon;
+  }
+  return strdup(fullnick);
 }
 
 char *stripwhite(char *string) {
@@ -1022,120 +3578,707 @@ char *stripwhite(char *string) {
   return s;
 }
 
-static char *parse_recipient(const char *logbuf) {
-  char *rcp = strstr(logbuf, "<" COLOR_INCOMING);
-  char *ercp = strstr(logbuf, COLOR_RESET ">");
-  char *recip = NULL;
-  int len = 0;
+struct scrollback *find_scrollback(const char *name) {
+  struct scrollback *sb;
+
+  LIST_FOREACH(sb, SB_BUCKET(name), hash) {
+    if (irc_strcasecmp(sb->name, name) == 0)
+      return sb;
+  }
+  return NULL;
+}
 
-  if (rcp && ercp) {
-    rcp += strlen("<" COLOR_INCOMING);
-    len = ercp - rcp + 1;
+/* a ring for name: carve a slab of rings from the arena, or recycle the
+ * one written least recently once SB_MAX_RINGS exist */
+static struct scrollback *alloc_scrollback(const char *name) {
+  struct scrollback *sb;
+  size_t stride;
+  char *slab;
+  int i;
 
-    recip = calloc(len + 1, sizeof(char));
-    strlcpy(recip, rcp, len);
-    return recip;
+  if (scrollbacks.count >= SB_MAX_RINGS) {
+    sb = TAILQ_LAST(&scrollbacks.lru, sb_lru);
+    TAILQ_REMOVE(&scrollbacks.lru, sb, lru);
+    LIST_REMOVE(sb, hash);
+    scrollbacks.count--;
   } else {
-    return NULL;
+    if (LIST_EMPTY(&scrollbacks.free)) {
+      /* each ring: its header, the line offsets and the record bytes */
+      stride = SB_ALIGN(sizeof(struct scrollback)) +
+               SB_ALIGN(scrollbacks.lines * sizeof(uint32_t)) +
+               scrollbacks.bytes;
+      if (!(slab = calloc(SB_SLAB, stride)))
+        eprint("ircl: unable to grow scrollback:");
+      scrollbacks.arena += SB_SLAB * stride;
+      for (i = 0; i < SB_SLAB; i++) {
+        sb = (struct scrollback *)(slab + i * stride);
+        sb->offs = (uint32_t *)((char *)sb +
+                                SB_ALIGN(sizeof(struct scrollback)));
+        sb->ring = (char *)sb->offs +
+                   SB_ALIGN(scrollbacks.lines * sizeof(uint32_t));
+        LIST_INSERT_HEAD(&scrollbacks.free, sb, hash);
+      }
+    }
+    sb = LIST_FIRST(&scrollbacks.free);
+    LIST_REMOVE(sb, hash);
   }
+  strlcpy(sb->name, name, sizeof sb->name);
+  sb->head = sb->count = 0;
+  sb->end = 0;
+  LIST_INSERT_HEAD(SB_BUCKET(name), sb, hash);
+  TAILQ_INSERT_HEAD(&scrollbacks.lru, sb, lru);
+  scrollbacks.count++;
+  return sb;
 }
 
-static void add_msg_history(const char *channel, const char *message) {
-  hist_elem e;
-  if (hist_size > MAX_HISTORY) {
-    e = SIMPLEQ_FIRST(&hist_head);
-    SIMPLEQ_REMOVE_HEAD(&hist_head, entries);
-    free(e->channel);
-    free(e->msg);
-  } else {
-    hist_size++;
+/* Append a record to name's ring. Records are never split: one that won't
+ * fit before the end of the ring starts again at the front. The oldest
+ * records go first, to stay within both the line and the byte budget. */
+static void sb_append(const char *name, const struct irc_event *ev) {
+  struct scrollback *sb;
+  struct sb_record *rec;
+  size_t sender_len = ev->source ? strlen(ev->source) : 0;
+  size_t arg_len = ev->arg ? strlen(ev->arg) : 0;
+  size_t text_len = ev->text ? strlen(ev->text) : 0;
+  size_t len, oldest;
+
+  if (!name || !*name)
+    return;
+  if (sender_len > 255)
+    sender_len = 255;
+  if (arg_len > 255)
+    arg_len = 255;
+  len = offsetof(struct sb_record, data) + sender_len + arg_len + 3;
+  if (text_len > SB_TEXT_MAX)
+    text_len = SB_TEXT_MAX;
+  if (len + text_len > scrollbacks.bytes)
+    text_len = scrollbacks.bytes - len;
+  len = SB_ALIGN(len + text_len);
+
+  if (!(sb = find_scrollback(name)))
+    sb = alloc_scrollback(name);
+  else if (sb != TAILQ_FIRST(&scrollbacks.lru)) {
+    TAILQ_REMOVE(&scrollbacks.lru, sb, lru);
+    TAILQ_INSERT_HEAD(&scrollbacks.lru, sb, lru);
+  }
+
+  if (sb->count == scrollbacks.lines) {
+    sb->head = (sb->head + 1) % scrollbacks.lines;
+    sb->count--;
+  }
+  for (;;) {
+    if (sb->count == 0) {
+      sb->end = 0;
+      break;
+    }
+    oldest = sb->offs[sb->head];
+    if (sb->end > oldest) {
+      if (scrollbacks.bytes - sb->end >= len)
+        break;
+      sb->end = 0; /* wrap; the tail is dead space */
+      continue;
+    }
+    if (oldest - sb->end >= len)
+      break;
+    sb->head = (sb->head + 1) % scrollbacks.lines;
+    sb->count--;
   }
-  e = malloc(sizeof(struct hist_elem));
-  e->msg = strdup(message);
-  e->channel = strdup(channel);
-  SIMPLEQ_INSERT_TAIL(&hist_head, e, entries);
+
+  rec = (struct sb_record *)(sb->ring + sb->end);
+  rec->time = ev->time;
+  rec->kind = ev->kind;
+  rec->sender_len = sender_len;
+  rec->arg_len = arg_len;
+  memcpy(rec->data, ev->source ? ev->source : "", sender_len);
+  rec->data[sender_len] = '\0';
+  memcpy(rec->data + sender_len + 1, ev->arg ? ev->arg : "", arg_len);
+  rec->data[sender_len + 1 + arg_len] = '\0';
+  memcpy(rec->data + sender_len + arg_len + 2, ev->text ? ev->text : "",
+         text_len);
+  rec->data[sender_len + arg_len + 2 + text_len] = '\0';
+  sb->offs[(sb->head + sb->count) % scrollbacks.lines] = sb->end;
+  sb->count++;
+  sb->end += len;
 }
 
-static void handle_last(const char *channel) {
-  hist_elem e;
-  if (!channel || !*channel) {
+/* /last <channel> [N]: the newest N records, oldest first */
+static void handle_last(const char *args) {
+  struct scrollback *sb;
+  struct sb_record *rec;
+  struct irc_event ev;
+  const char *window;
+  char name[NICK_NAME_MAX], timestr[32], line[4096];
+  unsigned i, n = 0;
+
+  if (!args || sscanf(args, "%63s %u", name, &n) < 1) {
     pout("ircl", "Must specify a channel to replay.");
     return;
   }
+  if (!(sb = find_scrollback(name))) {
+    pout("ircl", "Nothing to replay for %s", name);
+    return;
+  }
+  if (n == 0 || n > sb->count)
+    n = sb->count;
+  render_begin();
   fprintf(rl_outstream, "\n");
-  SIMPLEQ_FOREACH(e, &hist_head, entries) {
-    if (e != NULL && strncmp(channel, e->channel, strlen(channel)) == 0) {
-      fprintf(rl_outstream, "> %s", e->msg);
-    }
+  for (i = sb->count - n; i < sb->count; i++) {
+    rec = (struct sb_record *)(sb->ring +
+                               sb->offs[(sb->head + i) % scrollbacks.lines]);
+    ev.kind = rec->kind;
+    ev.time = rec->time;
+    ev.source = rec->data;
+    ev.target = sb->name; /* right for everything kept under a channel */
+    ev.arg = rec->data + rec->sender_len + 1;
+    ev.text = ev.arg + rec->arg_len + 1;
+    strftime(timestr, sizeof timestr, "%D %T", localtime(&rec->time));
+    format_event(line, sizeof line, &ev);
+    window = event_window(&ev);
+    fprintf(rl_outstream, "> %s : %s%s" COLOR_RESET " %s\n", timestr,
+            channel_color(window), window, line);
   }
+  render.nlines += n;
 }
 
+static void initialize_scrollback() {
+  int i;
+
+  for (i = 0; i < SB_BUCKETS; i++)
+    LIST_INIT(&scrollbacks.buckets[i]);
+  TAILQ_INIT(&scrollbacks.lru);
+  LIST_INIT(&scrollbacks.free);
+}
+
+/* map ~/.irclusers as it is now; an empty or missing file maps nothing */
+static void users_map() {
+  struct stat st;
+  void *map;
+  int fd;
+
+  if ((fd = open(users.path, O_RDONLY)) == -1)
+    return;
+  if (fstat(fd, &st) == 0) {
+    users.size = st.st_size;
+    users.mtime = st.st_mtime;
+    if (st.st_size > 0 && st.st_size < UINT32_MAX &&
+        (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) !=
+            MAP_FAILED)
+      users.map = map;
+  }
+  close(fd);
+}
+
+/* map ~/.irclusers; nothing is read until the first completion */
 static void load_usernames_file() {
-  FILE *user_file = NULL;
-  char user_file_path[PATH_MAX];
-  char *line = NULL;
-  const char *home_path = NULL;
-  ssize_t chars_read = 0;
-  size_t len = 0;
-  int count = 0, i = 0;
-  SLIST_HEAD(listhead, entry) head = SLIST_HEAD_INITIALIZER(head);
-  struct entry {
-    SLIST_ENTRY(entry) entries;
-    const char *name;
-  } * entp;
-
-  home_path = getenv("HOME");
+  const char *home_path = getenv("HOME");
+
   if (home_path == NULL) {
     home_path = "/tmp";
   }
-  snprintf(user_file_path, sizeof user_file_path, "%s/.irclusers", home_path);
-  user_file = fopen(user_file_path, "r");
-  if (user_file == NULL) {
-    usernames = NULL;
+  snprintf(users.path, sizeof users.path, "%s/.irclusers", home_path);
+  snprintf(users.index_path, sizeof users.index_path, "%s.idx", users.path);
+  users_map();
+}
+
+/* ~/.irclusers changed: map it again and, if completion has indexed it,
+ * carry the index over by applying only the names added and removed.
+ * Old names are matched by hash, as their bytes may be gone; the kept
+ * ones stay in order, so only the additions need sorting. */
+static void users_reload() {
+  struct user_file old = users;
+  struct user_ref *added = NULL, *merged, r = {0, 0};
+  uint32_t *slots, *offs;
+  size_t nslots = 1, mask, nadded = 0, cap = 0, nkept = 0, i, j, k, len;
+  const char *p, *end, *nl;
+  struct timespec t0;
+  uint64_t h;
+
+  stats_start(&t0);
+  users.map = NULL;
+  users.size = 0;
+  users.mtime = 0;
+  users.index_map = NULL;
+  users.index_size = 0;
+  users.built = NULL;
+  users.refs = NULL;
+  users.hashes = NULL;
+  users.count = 0;
+  users.indexed = false;
+  users.reloads++;
+  users_map();
+  if (old.indexed && users.map) {
+    while (nslots < old.count * 2)
+      nslots *= 2;
+    mask = nslots - 1;
+    if (!(slots = calloc(nslots, sizeof *slots)) ||
+        !(offs = malloc((old.count + 1) * sizeof *offs)))
+      eprint("ircl: malloc:");
+    for (i = 0; i < old.count; i++) {
+      for (j = old.hashes[i] & mask; slots[j]; j = (j + 1) & mask)
+        ;
+      slots[j] = i + 1;
+      offs[i] = UINT32_MAX; /* gone, unless seen below */
+    }
+    for (p = users.map, end = users.map + users.size; p < end; p = nl + 1) {
+      if (!(nl = memchr(p, '\n', end - p)))
+        nl = end;
+      len = nl - p;
+      if (len && p[len - 1] == '\r')
+        len--;
+      if (len < 2)
+        continue;
+      h = user_hash(p, len);
+      for (j = h & mask; slots[j]; j = (j + 1) & mask) {
+        k = slots[j] - 1;
+        if (old.hashes[k] == h && offs[k] == UINT32_MAX)
+          break;
+      }
+      if (slots[j]) {
+        offs[k] = p - users.map;
+        nkept++;
+        continue;
+      }
+      if (nadded == cap) {
+        cap = cap ? cap * 2 : 64;
+        if (!(added = realloc(added, cap * sizeof *added)))
+          eprint("ircl: realloc:");
+      }
+      added[nadded++] = (struct user_ref){p - users.map, len};
+    }
+    qsort(added, nadded, sizeof *added, user_cmp);
+    if (!(merged = malloc((nkept + nadded + 1) * sizeof *merged)))
+      eprint("ircl: malloc:");
+    for (i = j = 0; i < old.count || j < nadded;) {
+      if (i < old.count && offs[i] == UINT32_MAX) {
+        i++;
+        continue;
+      }
+      if (i < old.count)
+        r = (struct user_ref){offs[i], old.refs[i].len};
+      if (i < old.count && (j == nadded || user_cmp(&r, &added[j]) <= 0)) {
+        merged[users.count++] = r;
+        i++;
+      } else {
+        merged[users.count++] = added[j++];
+      }
+    }
+    users.built = merged;
+    users.refs = merged;
+    users.indexed = true;
+    users_index_keep();
+    users.added += nadded;
+    users.removed += old.count - nkept;
+    free(added);
+    free(offs);
+    free(slots);
+  } else if (old.indexed) {
+    users.indexed = true; /* nothing left to index */
+    users.removed += old.count;
+  }
+  if (old.map)
+    munmap((void *)old.map, old.size);
+  if (old.index_map)
+    munmap(old.index_map, old.index_size);
+  free(old.built);
+  free(old.hashes);
+  stats_stop(ST_RELOAD, &t0);
+  if (users.indexed)
+    pout("ircl", "Reloaded %s: %zu names, %zu added, %zu removed",
+         users.path, users.count, nadded, old.count - nkept);
+  else
+    pout("ircl", "Reloaded %s", users.path);
+}
+
+/* reload when ~/.irclusers appears, changes or goes away */
+static void users_check() {
+  struct stat st;
+  bool changed;
+
+  if (stat(users.path, &st) == 0)
+    changed = st.st_mtime != users.mtime || (size_t)st.st_size != users.size;
+  else
+    changed = users.mtime != 0;
+  if (changed)
+    users_reload();
+}
+
+/* inotify on $HOME sees a symlink replaced, not the file it points to */
+static bool watch_links() {
+  struct stat st;
+
+  return (lstat(users.path, &st) == 0 && S_ISLNK(st.st_mode)) ||
+         (lstat(keywords_path, &st) == 0 && S_ISLNK(st.st_mode));
+}
+
+/* without inotify, or for symlinks: stat the files every
+ * WATCH_CHECK_SECS */
+static void watch_check() {
+  keywords_check();
+  users_check();
+  if (!watch_inotify || watch_links())
+    ev_timer_arm(&watch_timer, WATCH_CHECK_SECS * 1000);
+}
+
+#ifdef __linux__
+/* Something in $HOME was written, moved or removed: reread our files if
+ * it was one of them. Cache and temporary files go by as well. Once
+ * ~/.irclusers is being written in place its mapping is dropped at once,
+ * as a truncated file would fault on the next completion, and it is read
+ * again when the writer closes it or goes quiet. */
+static void watch_ready(int fd, int events) {
+  char buf[WATCH_BUF]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ev;
+  const char *users_name = strrchr(users.path, '/') + 1;
+  const char *keywords_name = strrchr(keywords_path, '/') + 1;
+  bool users_changed = false, users_writing = false, keywords_changed = false;
+  ssize_t n, i;
+
+  UNUSED(events);
+  while ((n = read(fd, buf, sizeof buf)) > 0) {
+    for (i = 0; i < n; i += sizeof *ev + ev->len) {
+      ev = (const struct inotify_event *)(buf + i);
+      if (ev->mask & IN_Q_OVERFLOW) {
+        users_changed = keywords_changed = true;
+        users_writing = false;
+      } else if (ev->len && !strcmp(ev->name, users_name)) {
+        /* the last event says whether a write is still going on */
+        users_writing = (ev->mask & IN_MODIFY) != 0;
+        users_changed = !users_writing;
+      } else if (ev->len && !strcmp(ev->name, keywords_name)) {
+        keywords_changed |= !(ev->mask & IN_MODIFY);
+      }
+    }
+  }
+  if (keywords_changed)
+    keywords_reload();
+  if (users_writing) {
+    if (users.map) {
+      munmap((void *)users.map, users.size);
+      users.map = NULL;
+    }
+    ev_timer_arm(&users_settle_timer, WATCH_SETTLE_MS);
+  } else if (users_changed) {
+    ev_timer_cancel(&users_settle_timer);
+    users_reload();
+  }
+  if ((users_changed || users_writing || keywords_changed) &&
+      !watch_timer.armed && watch_links())
+    ev_timer_arm(&watch_timer, WATCH_CHECK_SECS * 1000);
+}
+#endif
+
+/* reread ~/.irclusers and ~/.irclkeywords when they change: watch $HOME
+ * with inotify where there is one, else, or for files that are symlinks,
+ * stat them every few seconds */
+static void initialize_watch() {
+#ifdef __linux__
+  char dir[PATH_MAX];
+  int fd;
+
+  strlcpy(dir, users.path, sizeof dir);
+  *strrchr(dir, '/') = '\0';
+  if ((fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) != -1) {
+    if (inotify_add_watch(fd, *dir ? dir : "/",
+                          IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO |
+                              IN_MOVED_FROM | IN_DELETE) != -1) {
+      ev_io_add(fd, EV_READ, watch_ready);
+      watch_inotify = true;
+      if (watch_links())
+        ev_timer_arm(&watch_timer, WATCH_CHECK_SECS * 1000);
+      return;
+    }
+    close(fd);
+  }
+#endif
+  ev_timer_arm(&watch_timer, WATCH_CHECK_SECS * 1000);
+}
+
+static void timespec_add_ms(struct timespec *ts, long ms) {
+  ts->tv_sec += ms / 1000;
+  ts->tv_nsec += (ms % 1000) * 1000000L;
+  if (ts->tv_nsec >= 1000000000L) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000L;
+  }
+}
+
+/* milliseconds from now until ts, rounded up; 0 if already past */
+static long ms_until(const struct timespec *ts) {
+  struct timespec now;
+  long ms;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  ms = (ts->tv_sec - now.tv_sec) * 1000 +
+       (ts->tv_nsec - now.tv_nsec + 999999) / 1000000;
+  return ms > 0 ? ms : 0;
+}
+
+/* milliseconds elapsed since ts */
+static long ms_since(const struct timespec *ts) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - ts->tv_sec) * 1000 +
+         (now.tv_nsec - ts->tv_nsec) / 1000000;
+}
+
+static void initialize_event_loop() {
+#ifdef __linux__
+  if ((loop.epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+    eprint("ircl: epoll_create1:");
+#endif
+}
+
+static struct ev_io *ev_io_find(int fd) {
+  int i;
+
+  for (i = 0; i < loop.nio; i++) {
+    if (loop.io[i].fd == fd)
+      return &loop.io[i];
+  }
+  return NULL;
+}
+
+#ifdef __linux__
+static void ev_epoll_ctl(int op, int fd, int events) {
+  struct epoll_event ev = {0};
+
+  ev.data.fd = fd;
+  ev.events = ((events & EV_READ) ? EPOLLIN : 0) |
+              ((events & EV_WRITE) ? EPOLLOUT : 0);
+  if (epoll_ctl(loop.epfd, op, fd, &ev) == -1)
+    eprint("ircl: epoll_ctl:");
+}
+#endif
+
+/* watch fd; func runs with the ready EV_* bits */
+static void ev_io_add(int fd, int events, ev_io_func func) {
+  if (loop.nio == EV_MAX_FDS)
+    eprint("ircl: too many watched descriptors\n");
+  loop.io[loop.nio].fd = fd;
+  loop.io[loop.nio].events = events;
+  loop.io[loop.nio].func = func;
+  loop.nio++;
+#ifdef __linux__
+  ev_epoll_ctl(EPOLL_CTL_ADD, fd, events);
+#endif
+}
+
+static void ev_io_mod(int fd, int events) {
+  struct ev_io *io = ev_io_find(fd);
+
+  if (!io || io->events == events)
+    return;
+  io->events = events;
+#ifdef __linux__
+  ev_epoll_ctl(EPOLL_CTL_MOD, fd, events);
+#endif
+}
+
+/* call before closing fd */
+static void ev_io_del(int fd) {
+  struct ev_io *io = ev_io_find(fd);
+
+  if (!io)
     return;
+  *io = loop.io[--loop.nio];
+#ifdef __linux__
+  epoll_ctl(loop.epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+}
+
+/* (re)schedule t to run func once, ms from now */
+static void ev_timer_arm(struct ev_timer *t, long ms) {
+  int i;
+
+  clock_gettime(CLOCK_MONOTONIC, &t->when);
+  timespec_add_ms(&t->when, ms);
+  t->armed = true;
+  for (i = 0; i < loop.ntimers; i++) {
+    if (loop.timers[i] == t)
+      return;
+  }
+  if (loop.ntimers == EV_MAX_TIMERS)
+    eprint("ircl: too many timers\n");
+  loop.timers[loop.ntimers++] = t;
+}
+
+static void ev_timer_cancel(struct ev_timer *t) { t->armed = false; }
+
+/* ms until the earliest armed timer, or -1 to sleep until an fd is ready */
+static int ev_next_timeout() {
+  long ms, timeout = -1;
+  int i;
+
+  for (i = 0; i < loop.ntimers; i++) {
+    if (!loop.timers[i]->armed)
+      continue;
+    ms = ms_until(&loop.timers[i]->when);
+    if (timeout < 0 || ms < timeout)
+      timeout = ms;
   }
-  while ((chars_read = getline(&line, &len, user_file)) != -1) {
-    if (chars_read > 2) {
-      line[chars_read - 1] = '\0'; /* remove delimiter */
-      entp = malloc(sizeof(struct entry));
-      entp->name = strdup(line);
-      SLIST_INSERT_HEAD(&head, entp, entries);
-      count++;
+  return timeout;
+}
+
+static void ev_run_timers() {
+  struct ev_timer *t;
+  int i;
+
+  for (i = 0; i < loop.ntimers; i++) {
+    t = loop.timers[i];
+    if (t->armed && ms_until(&t->when) == 0) {
+      t->armed = false;
+      t->func();
     }
   }
-  fclose(user_file);
-  free(line);
+}
+
+/* sleep until a watched fd is ready or a timer is due, and dispatch */
+static void ev_run_once() {
+  struct ev_io *io;
+  int i, n, events, timeout = ev_next_timeout();
+  long wait;
+#ifdef __linux__
+  struct epoll_event ready[EV_MAX_FDS];
+
+  /* with output pending, only peek: more input joins the batch, and the
+   * batch goes out before the loop really sleeps */
+  if (render.open && ((wait = render_wait()) < timeout || timeout < 0))
+    timeout = wait;
+  n = epoll_wait(loop.epfd, ready, EV_MAX_FDS, timeout);
+  if (n == -1 && errno != EINTR)
+    eprint("ircl: epoll_wait:");
+  if (n <= 0 && !render_wait())
+    render_flush();
+  for (i = 0; i < n; i++) {
+    /* an earlier callback may have dropped or replaced this fd */
+    if (!(io = ev_io_find(ready[i].data.fd)))
+      continue;
+    events = ((ready[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) ? EV_READ : 0) |
+             ((ready[i].events & EPOLLOUT) ? EV_WRITE : 0);
+    io->func(io->fd, events);
+  }
+#else
+  struct pollfd pfd[EV_MAX_FDS];
+  int nfds = loop.nio;
+
+  for (i = 0; i < nfds; i++) {
+    pfd[i].fd = loop.io[i].fd;
+    pfd[i].events = ((loop.io[i].events & EV_READ) ? POLLIN : 0) |
+                    ((loop.io[i].events & EV_WRITE) ? POLLOUT : 0);
+    pfd[i].revents = 0;
+  }
+  if (render.open && ((wait = render_wait()) < timeout || timeout < 0))
+    timeout = wait;
+  n = poll(pfd, nfds, timeout);
+  if (n == -1 && errno != EINTR)
+    eprint("ircl: poll:");
+  if (n <= 0 && !render_wait())
+    render_flush();
+  for (i = 0; n > 0 && i < nfds; i++) {
+    if (!pfd[i].revents || !(io = ev_io_find(pfd[i].fd)))
+      continue;
+    events = ((pfd[i].revents & (POLLIN | POLLHUP | POLLERR)) ? EV_READ : 0) |
+             ((pfd[i].revents & POLLOUT) ? EV_WRITE : 0);
+    io->func(io->fd, events);
+  }
+#endif
+  ev_run_timers();
+}
+
+static void stdin_ready(int fd, int events) {
+  UNUSED(fd);
+  UNUSED(events);
+  render_flush(); /* keys edit the line as shown, so put it back first */
+  rl_callback_read_char();
+}
+
+static void signal_ready(int fd, int events) {
+  char buf[64];
 
-  usernames = calloc(count + 1, sizeof(char *));
-  for (i = 0; i < count; i++) {
-    entp = SLIST_FIRST(&head);
-    SLIST_REMOVE_HEAD(&head, entries);
-    usernames[i] = entp->name;
-    free(entp);
+  UNUSED(events);
+  while (read(fd, buf, sizeof buf) > 0)
+    ;
+  if (log_reopen_pending) {
+    log_reopen_pending = 0;
+    log_reopen();
+  }
+  if (resize_pending) {
+    resize_pending = 0;
+    render_flush();
+    rl_resize_terminal();
+  }
+}
+
+static void srv_ready(int fd, int events) {
+  int i;
+
+  UNUSED(fd);
+  if (conn == CONN_HANDSHAKE) {
+    ssl_handshake();
+    return;
   }
-  usernames[count] = NULL; /* sentinel */
+  if ((events & EV_WRITE) || sendq.retry)
+    send_flush();
+  if (!(events & EV_READ))
+    return;
+  do {
+    i = recv_fill();
+    if (i == 0) {
+      eprint_reconnect("ircl: remote host closed connection\n");
+      return;
+    } else if (i < 0) {
+      if (errno != EAGAIN && errno != EINTR) {
+        if (use_ssl)
+          eprint_reconnect("Unable to read over SSL (err=%d)\n",
+                           SSL_get_error(ssl, i));
+        else
+          eprint_reconnect("ircl: error reading from server:");
+        return;
+      }
+      break;
+    }
+    recv_frame();
+  } while (use_ssl && ssl && SSL_pending(ssl) > 0);
+  clock_gettime(CLOCK_MONOTONIC, &trespond);
+  pinged = false;
+  ev_timer_arm(&ping_timer, KEEPALIVE_SECS * 1000);
 }
 
-/* true when ts was at least secs seconds ago */
-bool seconds_ago(struct timespec *ts, time_t secs) {
-  struct timespec tnow = {0};
-  clock_gettime(CLOCK_MONOTONIC, &tnow);
-  return ((tnow.tv_sec - ts->tv_sec) >= secs);
+/* the server has been quiet for a while: ping it, then give up on it */
+static void keepalive() {
+  struct timespec now = {0};
+
+  if (conn == CONN_HANDSHAKE) {
+    eprint_reconnect("ircl: TLS handshake timed out\n");
+    return;
+  }
+  if (!pinged) {
+    sout_urgent("PING %s", host);
+    clock_gettime(CLOCK_MONOTONIC, &last_ping);
+    stats.lag_sent = last_ping;
+    stats.lag_pending = true;
+    pinged = true;
+    ev_timer_arm(&ping_timer, (PING_TIMEOUT_SECS - KEEPALIVE_SECS) * 1000);
+    return;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  eprint_reconnect("ircl shutting down: parse timeout (last heard from "
+                   "%li secs ago, last ping attempt %li secs ago)\n",
+                   now.tv_sec - trespond.tv_sec, now.tv_sec - last_ping.tv_sec);
 }
 
 int main(int argc, char *argv[]) {
   int i, c;
-  struct timespec trespond = {0};
-  struct timespec last_ping = {0};
-  struct timeval tv = {120, 0};
   const char *user = getenv("USER");
-  char bufin[131072];
-  fd_set rd;
-
-  LIST_INIT(&nick_list_head);
-  clock_gettime(CLOCK_MONOTONIC, &trespond);
-  last_ping = trespond;
+  struct sigaction sa;
+#ifdef __OpenBSD__
+  char tmp_path[PATH_MAX + 16];
+#endif
 
+  /* output is written a batch at a time by render_flush() */
+  setvbuf(stdout, NULL, _IOFBF, RENDER_BUF_SIZE);
   strlcpy(default_nick, user ? user : "unknown", sizeof default_nick);
   for (i = 1; i < argc; i++) {
     c = argv[i][1];
@@ -1161,6 +4304,13 @@ int main(int argc, char *argv[]) {
     case 'v':
       eprint("ircl-" VERSION "\n");
       break;
+    case 'V':
+      verbose = true;
+      break;
+    case 'S':
+      if (++i < argc && !(stats.dump = fopen(argv[i], "a")))
+        eprint("ircl: %s:", argv[i]);
+      break;
     case 's':
       use_ssl = true;
       break;
@@ -1168,16 +4318,77 @@ int main(int argc, char *argv[]) {
       if (++i < argc)
         initialize_logging(argv[i]);
       break;
+    case 'N':
+      if (++i < argc && (nicks.capacity = strtoul(argv[i], NULL, 10)) == 0)
+        eprint("ircl: nick capacity must be a positive number\n");
+      break;
+    case 'H':
+      if (++i < argc) {
+        char *end;
+
+        scrollbacks.lines = strtoul(argv[i], &end, 10);
+        if (*end == ':')
+          scrollbacks.bytes = strtoul(end + 1, &end, 10);
+        if (*end || scrollbacks.lines == 0 || scrollbacks.lines > SB_LINES_MAX ||
+            scrollbacks.bytes < SB_BYTES_MIN || scrollbacks.bytes > UINT32_MAX)
+          eprint("ircl: scrollback must be lines[:bytes], at most %d lines "
+                 "and at least %d bytes\n", SB_LINES_MAX, SB_BYTES_MIN);
+      }
+      break;
+    case 'f':
+      if (++i < argc) {
+        if (!strcmp(argv[i], "never"))
+          logw.sync = LOG_SYNC_NEVER;
+        else if (!strcmp(argv[i], "flush"))
+          logw.sync = LOG_SYNC_FLUSH;
+        else if (!strcmp(argv[i], "always"))
+          logw.sync = LOG_SYNC_ALWAYS;
+        else
+          eprint("ircl: fsync policy must be never, flush or always\n");
+      }
+      break;
     default:
-      eprint("usage: ircl [-h host] [-p port] [-s] [-l log file] [-n nick] [-k "
-             "password] [-v]\n");
+      eprint("usage: ircl [-h host] [-p port] [-s] [-l log file] "
+             "[-f never|flush|always] [-n nick] [-N max nicks] "
+             "[-H lines[:bytes]] [-S stats file] [-k password] [-v] "
+             "[-V]\n");
     }
   }
   if (!log_file_path) {
     initialize_logging(NULL);
   }
-
+  initialize_casemap();
+  initialize_nicks();
+  initialize_channels();
+  initialize_scrollback();
+  srandom(time(NULL) ^ getpid()); /* reconnect jitter */
+  atexit(log_flush);
+  if (stats.dump)
+    atexit(stats_dump);
+  initialize_event_loop();
+  clock_gettime(CLOCK_MONOTONIC, &stats.started);
+  ev_timer_arm(&stats_timer, STATS_SECS * 1000);
+  initialize_highlight();
+  if (pipe(signal_pipe) == -1)
+    eprint("ircl: pipe:");
+  for (i = 0; i < 2; i++)
+    fcntl(signal_pipe[i], F_SETFL, fcntl(signal_pipe[i], F_GETFL) | O_NONBLOCK);
+  ev_io_add(signal_pipe[0], EV_READ, signal_ready);
+  if (pipe(dialer.dns_pipe) == -1)
+    eprint("ircl: pipe:");
+  fcntl(dialer.dns_pipe[0], F_SETFL,
+        fcntl(dialer.dns_pipe[0], F_GETFL) | O_NONBLOCK);
+  ev_io_add(dialer.dns_pipe[0], EV_READ, dns_ready);
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = handle_signal;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGHUP, &sa, NULL);
+  sigaction(SIGWINCH, &sa, NULL);
+
+  if (use_ssl)
+    initialize_ssl();
   initialize_readline();
+  initialize_watch();
 #ifdef __OpenBSD__
   if (pledge("dns stdio tty rpath cpath wpath inet unveil", NULL) == -1) {
     eprint("Pledge:%s", strerror(errno));
@@ -1185,6 +4396,26 @@ int main(int argc, char *argv[]) {
   if (unveil(log_file_path, "rwc") == -1) {
     eprint("unveil: %s", strerror(errno));
   }
+  if (use_ssl && unveil(tls_session_path, "rwc") == -1) {
+    eprint("unveil: %s", strerror(errno));
+  }
+  snprintf(tmp_path, sizeof tmp_path, "%s.tmp", tls_session_path);
+  if (use_ssl && unveil(tmp_path, "rwc") == -1) {
+    eprint("unveil: %s", strerror(errno));
+  }
+  if (unveil(keywords_path, "r") == -1) {
+    eprint("unveil: %s", strerror(errno));
+  }
+  if (unveil(users.path, "r") == -1) {
+    eprint("unveil: %s", strerror(errno));
+  }
+  if (unveil(users.index_path, "rwc") == -1) {
+    eprint("unveil: %s", strerror(errno));
+  }
+  snprintf(tmp_path, sizeof tmp_path, "%s.tmp", users.index_path);
+  if (unveil(tmp_path, "rwc") == -1) {
+    eprint("unveil: %s", strerror(errno));
+  }
   if (unveil("/etc/ssl", "r") == -1) {
     eprint("unveil: %s", strerror(errno));
   }
@@ -1197,75 +4428,12 @@ int main(int argc, char *argv[]) {
   }
 #endif
   /* init */
+  initialize_dispatch();
+  ev_io_add(STDIN_FILENO, EV_READ, stdin_ready);
   login();
 
   for (;;) { /* main loop */
-    FD_ZERO(&rd);
-    FD_SET(0, &rd);
-    FD_SET(fileno(srv), &rd);
-    i = select(fileno(srv) + 1, &rd, 0, 0, &tv);
-    tv.tv_sec = 120; /* fuckin linux resets this */
-    tv.tv_usec = 0;  /* fuckin linux resets this */
-    if (i < 0) {
-      if (!(errno == EINTR || errno == EAGAIN)) {
-        eprint_reconnect("ircl: error on select():");
-      }
-      continue;
-    } else if (i == 0) {
-      if (seconds_ago(&trespond, 120) && seconds_ago(&last_ping, 240)) {
-        sout("PING %s", host);
-        clock_gettime(CLOCK_MONOTONIC, &last_ping);
-      } else if (seconds_ago(&trespond, 300)) {
-        struct timespec now = {0};
-        clock_gettime(CLOCK_MONOTONIC, &now);
-        eprint_reconnect("ircl shutting down: parse timeout (last heard from "
-                         "%li secs ago, last ping attempt %li secs ago)\n",
-                         now.tv_sec - trespond.tv_sec,
-                         now.tv_sec - last_ping.tv_sec);
-      }
-      continue;
-    }
-    if (FD_ISSET(fileno(srv), &rd)) {
-      if (use_ssl) {
-        char *cmd, *ptr, *end;
-        i = SSL_read(ssl, bufin, sizeof(bufin) - 1);
-        if (i <= 0) {
-          eprint_reconnect("Unable to read over SSL (err=%d)\n",
-                           SSL_get_error(ssl, i));
-          continue;
-        }
-        ptr = cmd = bufin;
-        end = bufin + i;
-        *end = '\0';
-        while (ptr < end) {
-          if (*ptr == '\r') {
-            *ptr = '\0';
-            if (*(ptr + 1) != '\n') { // accept only CR as EOM
-              parsesrv(cmd);
-              cmd = ptr + 1;
-            }
-          } else if (*ptr == '\n') {
-            *ptr = '\0';
-            parsesrv(cmd);
-            cmd = ptr + 1;
-          }
-          ptr++;
-        }
-        if (cmd != ptr) {
-          fprintf(stderr, "INCOMPLETE CMD: '%s'\n", cmd);
-        }
-      } else {
-        if (fgets(bufin, sizeof bufin, srv) == NULL) {
-          eprint_reconnect("ircl: remote host closed connection\n");
-          continue;
-        }
-        parsesrv(bufin);
-      }
-      clock_gettime(CLOCK_MONOTONIC, &trespond);
-    }
-    if (FD_ISSET(0, &rd)) {
-      rl_callback_read_char();
-    }
+    ev_run_once();
   }
   return 0;
 }
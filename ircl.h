@@ -1,22 +1,46 @@
+#ifndef IRCL_H
+#define IRCL_H
+
+#ifdef __linux__
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 700 /* wcwidth() */
+#endif
+
 #include <stdlib.h>
 #include <err.h>
 #include <ctype.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <libgen.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <strings.h>
 #include <time.h>
+#include <wchar.h>
+#include <fnmatch.h>
 #include <unistd.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <sys/queue.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <poll.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#endif
 
 #include <openssl/ssl.h>
 #include <openssl/bio.h>
@@ -25,7 +49,11 @@
 
 
 #define UNUSED(x) (void)(x)
-#define MAX_NICKS 1024
+#define MAX_NICKS 16384
+#define NICK_SLAB 256
+#define NICK_NAME_MAX 64
+#define MEMBER_SLAB 1024
+#define COMPLETION_MAX 64
 #define ACTIVE_NICKS_QUEUE_SIZE 10
 #define COLOR_RESET "\033[00m"
 #define COLOR_OUTGOING "\033[00;33m"
@@ -37,10 +65,92 @@
 #ifndef PATH_MAX
   #define PATH_MAX 1024
 #endif
-#define MAX_HISTORY 4096
+#define SB_LINES 1000        /* default scrollback per channel */
+#define SB_BYTES 65536
+#define SB_LINES_MAX 1000000
+#define SB_BYTES_MIN 4096
+#define SB_TEXT_MAX 4096
+#define SB_MAX_RINGS 256      /* channels and nicks with scrollback */
+#define SB_SLAB 8
+#define SB_BUCKETS 256
+#define SB_ALIGN(n) (((n) + 7) & ~(size_t)7)
+#define SB_BUCKET(n) (&scrollbacks.buckets[irc_hash(n) & (SB_BUCKETS - 1)])
 #define MAX_NICK_LENGTH 32
+#define CHAN_NAME_MAX 201     /* 200 characters, the protocol's limit */
+#define CHAN_TOPIC_MAX 400
+#define CHAN_MODES_MAX 32
+#define CHAN_BUCKETS 16       /* to start with */
+#define LISTING_POOL 16384    /* WHO/NAMES strings, to start with */
+#define LISTING_ROWS 512
+#define LISTING_PENDING 8     /* WHO/NAMES requests awaiting their end */
+#define LISTING_PATTERN 64
+#define LISTING_HOST_MAX 40   /* user@host column width, at most */
+#define LISTING_SERVER_MAX 24
+#define HISTORY_LINES 100     /* per CHATHISTORY request, at most */
+#define HISTORY_PAGES 3       /* requests per channel after a rejoin */
+#define BATCH_MAX 8           /* BATCHes open at once */
+#define BATCH_REF_MAX 32
+#define RECV_BUF_SIZE 131072
+#define IRC_LINE_MAX 512       /* including CR LF */
+#define SENDQ_LINES 512
+#define IOV_BATCH 64
+#define FLOOD_BURST 5           /* lines that may go out back to back */
+#define FLOOD_INTERVAL_MS 2000  /* then one line per interval */
+#define RENDER_BUF_SIZE 65536
+#define RENDER_FRAME_MS 50      /* longest the prompt stays off screen */
+#define RENDER_HOLD_MS 2000     /* ... while a page of history arrives */
+#define RENDER_REPORT_LINES 100 /* -V: mention batches at least this big */
+#define LOG_BUF_SIZE 16384
+#define LOG_FLUSH_SECS 2
+#define KEEPALIVE_SECS 120    /* ping a server this quiet */
+#define PING_TIMEOUT_SECS 300 /* reconnect to a server this quiet */
+#define TLS_SESSION_MAX 16384 /* DER encoded */
+#define DIAL_MAX_ADDRS 8
+#define DIAL_STAGGER_MS 250   /* RFC 8305 connection attempt delay */
+#define DIAL_TIMEOUT_SECS 30   /* also bounds the TLS handshake */
+#define RECONNECT_MIN_MS 1000
+#define RECONNECT_MAX_MS 300000
+#define QUIT_DRAIN_MS 2000   /* how long /quit waits for the QUIT to go out */
+#define WATCH_CHECK_SECS 5    /* without inotify, stat the files this often */
+#define WATCH_BUF 4096        /* inotify events read at once */
+#define WATCH_SETTLE_MS 500   /* reload ~/.irclusers once writes stop */
+#define HL_MAX_SPANS 32       /* highlighted stretches per line */
+#define ARENA_BLOCK 16384     /* event arena grows in blocks this big */
+#define STATS_BUCKETS 24      /* log2 microseconds: <1, <2, <4 ... */
+#define STATS_SECS 60         /* lag probe, and -S dump interval */
+#define EV_MAX_FDS 16
+#define EV_MAX_TIMERS 16
+#define EV_READ 1
+#define EV_WRITE 2
+#define IRC_MAX_PARAMS 15
+#define VERB_TABLE_SIZE 32
+#define IRC_PARAM(m, i) ((i) < (m)->nparams ? (m)->params[i] : "")
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
 
+enum msg_kind {
+    MSG_INFO,    /* status and server lines, stored as shown */
+    MSG_PRIVMSG,
+    MSG_ACTION,
+    MSG_NOTICE,
+    MSG_JOIN,
+    MSG_PART,
+    MSG_KICK,
+    MSG_QUIT,
+    MSG_NICK,
+    MSG_TOPIC
+};
+
+/* something that happened, as parsesrv() or a command saw it; see emit() */
+struct irc_event {
+    enum msg_kind kind;
+    time_t time;
+    const char *source; /* nick, or server */
+    const char *target; /* channel, or us; NULL for QUIT and NICK */
+    const char *arg;    /* KICK: who was kicked */
+    const char *text;   /* message, reason, topic or new nick */
+    bool muted;         /* only completion hears about it */
+};
+
 #ifndef getline
 ssize_t  getline(char ** __restrict, size_t * __restrict,
                 FILE * __restrict);
@@ -51,8 +161,23 @@ int insert_nick(const char *nick);
 int remove_nick(const char *nick);
 void remove_all_nicks();
 void init_nick(const char *nick);
+void initialize_nicks();
+struct nick_entry *find_nick(const char *nick);
+static int irc_strcasecmp(const char *, const char *);
+static unsigned long irc_hash(const char *);
+static struct irc_channel *find_channel(const char *);
+static void rename_nick(const char *, const char *);
+static void add_member(struct irc_channel *, const char *, char);
+static bool remove_member(struct irc_channel *, const char *);
+static void drop_memberships(struct nick_entry *);
+static void clear_members(struct irc_channel *);
+static bool nick_in_channel(const struct nick_entry *,
+                            const struct irc_channel *);
 char *stripwhite (char *string);
 static void pout(const char *, char *, ...);
+static void render_flush();
+static void render_end();
+static long ms_since(const struct timespec *);
 void initialize_readline();
 static char *username_generator(const char *, int);
 static char *nick_generator(const char *, int);
@@ -66,15 +191,33 @@ static int nick_is_active(const char *);
 static void load_usernames_file();
 static void add_channel(const char *); 
 static void remove_channel(const char *);
-static void remove_all_channels();
 static const char* channel_color(const char *);
 static void ssl_connect(const int, const char *);
-static void add_msg_history(const char *, const char *);
+static void initialize_ssl();
+static void sb_append(const char *, const struct irc_event *);
+static void render_begin();
 static void logmsg(const char *msg, const int len);
+static void parsesrv(char *);
+static void initialize_dispatch();
+static int recv_fill();
+static void send_flush();
+static void keepalive();
+static void sout(char *, ...);
+static void sout_urgent(char *, ...);
+static void recv_frame();
+static int log_open();
+static void log_flush();
+static void log_reopen();
 static void login();
+static void login_connected(int);
+static void register_nick();
+static void disconnect();
+static void dial_abort();
+static void rejoin_channels();
+static void ssl_handshake();
+static void dial_next();
+static void dial_failed();
 static int in_ircl_channel();
-static char* parse_recipient(const char *);
-static int get_cursor_pos(int input_fd, int output_fd);
 
 
 /* command handlers */
@@ -88,12 +231,57 @@ static void handle_who_channel(const char*);
 static void handle_join(const char*);
 static void handle_last(const char*);
 static void handle_part(const char*);
-static void handle_who_all();
+static void handle_who_all(const char*);
+static void handle_names(const char*);
 static void handle_msg(const char*);
 static void handle_me(const char*);
 static void handle_switch(const char*);
 static void handle_away(const char*);
 static void handle_quit();
+static void handle_stats();
+
+/* a server line, split in place */
+struct irc_msg {
+    char *tags;                   /* raw IRCv3 tags without the '@', or NULL */
+    char *nick, *user, *host;     /* prefix; nick is the server name */
+    char *cmd;
+    char *params[IRC_MAX_PARAMS]; /* middle params followed by the trailing */
+    int nparams;
+    char *trailing;               /* last param, or "" */
+    time_t time;                  /* server-time, else when it was received */
+    long long ms;                 /* the same, in epoch milliseconds */
+    struct irc_batch *batch;      /* the BATCH it came in, or NULL */
+};
+
+/* IRCv3 capabilities we ask for */
+enum cap_flag {
+    CAP_BATCH = 1,
+    CAP_SERVER_TIME = 2,
+    CAP_MESSAGE_TAGS = 4,
+    CAP_CHATHISTORY = 8
+};
+#define CAP_HISTORY (CAP_BATCH | CAP_SERVER_TIME | CAP_CHATHISTORY)
+struct irc_batch {
+    char ref[BATCH_REF_MAX];
+    char target[CHAN_NAME_MAX];
+    bool history; /* a CHATHISTORY reply: drawn in one go */
+    int lines;
+    long long last_ms;
+};
+struct ircv3 {
+    unsigned caps;           /* acknowledged, enum cap_flag */
+    char want[IRC_LINE_MAX]; /* offered in CAP LS and wanted: to REQ */
+    int history_max;         /* CHATHISTORY= from 005, 0 if unlimited */
+    struct irc_batch batches[BATCH_MAX];
+    int nbatches;
+};
+
+/* server message handlers */
+typedef void (*srv_func)(struct irc_msg *);
+struct srv_handler {
+    const char *cmd;
+    srv_func func_ptr;
+};
 
 
 const char * IRCL_CHANNEL_NAME = "ircl%";
@@ -108,41 +296,370 @@ const struct command_handler command_map[] = {
     { "s", "switch", handle_switch},
     { "w", "who", handle_who_channel},
     { "W", "whoa", handle_who_all},
+    { "n", "names", handle_names},
+    { "S", "stats", handle_stats},
     { "Q", "quit", handle_quit},
     { NULL, NULL, 0 }  /* sentinel */
 };
+struct membership;
+LIST_HEAD(member_list, membership);
+/* channels we are in: hashed by RFC 1459 case-mapped name, and listed in
+ * the order they were joined */
 struct irc_channel {
-    const char *name;
-    const char *color;
-};
-struct irc_channel active_channels[] = {
-    {NULL, "\033[01;37m"}, /* white */
-    {NULL, "\033[01;35m"}, /* magenta */
-    {NULL, "\033[01;36m"}, /* cyan */
-    {NULL, "\033[01;32m"}, /* green */
-    {NULL, "\033[01;33m"}, /* yellow */
-    {NULL, "\033[01;34m"}, /* blue */
-    {NULL, "\033[01;37m"}, /* white */
-    {NULL, "\033[01;35m"}, /* magenta */
-    {NULL, "\033[01;36m"}, /* cyan */
-    {NULL, "\033[01;32m"}, /* green */
-    {NULL, "\033[01;33m"}, /* yellow */
-    {NULL, "\033[01;34m"}, /* blue */
-    {NULL, "\033[01;37m"}, /* white */
-    {NULL, "\033[01;35m"}, /* magenta */
-    {NULL, "\033[01;36m"}, /* cyan */
-    {NULL, "\033[01;32m"}, /* green */
-    {NULL, "\033[01;33m"}, /* yellow */
-    {NULL, "\033[01;34m"}, /* blue */
-};
-const int MAX_CHANNELS = sizeof(active_channels)/sizeof(struct irc_channel);
-const char** usernames;
-
-/* stores messaging history */
-typedef struct hist_elem {
-    SIMPLEQ_ENTRY(hist_elem) entries;
-    char *msg;
-    char *channel;
-} *hist_elem;
-SIMPLEQ_HEAD(hist_head, hist_elem) hist_head = SIMPLEQ_HEAD_INITIALIZER(hist_head);
-int hist_size = 0;
+    LIST_ENTRY(irc_channel) hash;
+    TAILQ_ENTRY(irc_channel) joined;
+    const char *color; /* picked by name hash, so it's the same every time */
+    struct member_list members;
+    int nmembers;
+    bool names_complete; /* seen 366; the next 353 starts a new list */
+    unsigned long unread, mentions; /* while not the default channel */
+    long long last_ms;   /* newest message seen, for CHATHISTORY AFTER */
+    long long live_ms;   /* our last JOIN: history from then on was live */
+    int history_pages;   /* CHATHISTORY requests since that JOIN */
+    unsigned long history_lines;
+    char modes[CHAN_MODES_MAX];
+    char topic[CHAN_TOPIC_MAX];
+    char name[CHAN_NAME_MAX];
+};
+LIST_HEAD(chan_bucket, irc_channel);
+struct channel_table {
+    struct chan_bucket *buckets;
+    size_t nbuckets; /* power of two, doubled as channels are joined */
+    size_t count;
+    TAILQ_HEAD(chan_order, irc_channel) order;
+};
+#define CHAN_BUCKET(n) \
+    (&channels.buckets[irc_hash(n) & (channels.nbuckets - 1)])
+const char *channel_colors[] = {
+    "\033[01;37m", /* white */
+    "\033[01;35m", /* magenta */
+    "\033[01;36m", /* cyan */
+    "\033[01;32m", /* green */
+    "\033[01;33m", /* yellow */
+    "\033[01;34m", /* blue */
+};
+#define CHANNEL_COLORS (sizeof(channel_colors) / sizeof(*channel_colors))
+
+/* ~/.irclusers is mapped read-only and names are used where they lie.
+ * The first completion sorts them by completion key into an index of
+ * (offset, length) pairs, cached as ~/.irclusers.idx for the next run
+ * while the file's mtime and size still match. */
+#define USERS_INDEX_MAGIC 0x78646975 /* "uidx" */
+#define USERS_INDEX_VERSION 1
+struct user_ref {
+    uint32_t off;
+    uint32_t len;
+};
+struct users_index_header {
+    uint32_t magic, version;
+    int64_t mtime;
+    uint64_t size;
+    uint64_t count;
+};
+/* ~/.irclusers, mapped shared: other programs rewrite it, in place or
+ * not, so completion stats it first and never reads refs into a file
+ * that has since changed size */
+struct user_file {
+    char path[PATH_MAX];
+    char index_path[PATH_MAX + 8];
+    const char *map;        /* the file, or NULL */
+    size_t size;
+    time_t mtime;
+    void *index_map;        /* the cached index, when mapped */
+    size_t index_size;
+    struct user_ref *built; /* or the one we sorted, if it couldn't be */
+    const struct user_ref *refs;
+    uint64_t *hashes;       /* of each ref's bytes, for diffing a reload */
+    size_t count;
+    bool indexed;
+    unsigned long reloads, added, removed; /* since startup */
+};
+
+/* scrollback: a ring of records per channel or nick, for /last */
+struct sb_record {
+    time_t time;
+    unsigned char kind;       /* enum msg_kind */
+    unsigned char sender_len;
+    unsigned char arg_len;
+    char data[];              /* sender NUL arg NUL text NUL */
+};
+struct scrollback {
+    LIST_ENTRY(scrollback) hash; /* bucket chain, or free list */
+    TAILQ_ENTRY(scrollback) lru;
+    char name[NICK_NAME_MAX];
+    uint32_t *offs;    /* ring of record offsets, oldest at head */
+    unsigned head, count;
+    char *ring;        /* record bytes */
+    size_t end;        /* where the next record goes */
+};
+struct scrollback_store {
+    LIST_HEAD(, scrollback) buckets[SB_BUCKETS];
+    TAILQ_HEAD(sb_lru, scrollback) lru;
+    LIST_HEAD(, scrollback) free;
+    size_t count;
+    size_t lines, bytes; /* budget of every ring */
+    size_t arena;        /* bytes carved out for rings so far */
+};
+
+/* transcript writer: keeps the log open and batches lines in memory */
+enum log_sync {
+    LOG_SYNC_NEVER,   /* leave it to the kernel */
+    LOG_SYNC_FLUSH,   /* fsync after every buffer flush */
+    LOG_SYNC_ALWAYS   /* flush and fsync every line */
+};
+struct log_writer {
+    int fd;
+    enum log_sync sync;
+    size_t len;
+    char buf[LOG_BUF_SIZE];
+};
+
+/* terminal output batch: see render_begin() */
+struct render_state {
+    bool open;
+    bool saved;         /* the prompt and input line are off screen */
+    struct timespec opened;
+    unsigned long nlines;          /* in this batch */
+    unsigned long lines, batches;  /* lines - batches = redraws saved */
+    int hold;                      /* history batches open: no redraws */
+};
+
+/* highlighting: our nick and the words in ~/.irclkeywords, compiled into
+ * an Aho-Corasick automaton over case-mapped bytes. Bytes that occur in no
+ * pattern share column 0, so each state's row stays short. */
+struct hl_pattern {
+    unsigned short len;
+    bool word_start, word_end; /* must not touch a word character there */
+};
+struct matcher {
+    unsigned short cols[256]; /* raw byte -> column */
+    int ncols, nstates;
+    int *delta;  /* nstates * ncols: goto and failure folded into a DFA */
+    int *out;    /* pattern that ends at the state, or -1 */
+    int *dict;   /* nearest state on the failure chain with an output */
+    struct hl_pattern *pats;
+    int npats, nkeywords;
+    time_t mtime; /* of the keyword file the patterns came from */
+    off_t size;
+};
+
+/* scratch memory for handling one server or input line: bump allocated,
+ * and emptied when the line is done; blocks are kept for the next line */
+struct arena_block {
+    struct arena_block *next;
+    size_t size, used;
+    char data[];
+};
+struct arena {
+    struct arena_block *first, *cur;
+};
+
+/* server input: lines are framed out of [start, end); a trailing partial
+ * line is carried over to the next read */
+struct recv_buf {
+    size_t start, end;
+    size_t scan; /* where to resume looking for a line terminator */
+    unsigned long dropped; /* overlong lines that had to be split */
+    char buf[RECV_BUF_SIZE + 1];
+};
+
+/* nicks (and joined channels) known for completion: hashed by RFC 1459
+ * case-mapped name, kept in most recently used order */
+struct nick_entry {
+    LIST_ENTRY(nick_entry) hash; /* bucket chain, or free list */
+    TAILQ_ENTRY(nick_entry) mru;
+    struct member_list channels;
+    unsigned long seen; /* registry clock at last touch, for ranking */
+    bool away;          /* WHO said G(one) */
+    char nick[NICK_NAME_MAX];
+};
+#define NICK_OF(name) \
+    ((struct nick_entry *)((char *)(name) - offsetof(struct nick_entry, nick)))
+
+/* names sorted by case-mapped key, for prefix lookups */
+struct prefix_index {
+    const char **names;
+    size_t count, size;
+};
+struct completion {
+    const char *names[COMPLETION_MAX]; /* best match first */
+    int count, next;
+};
+struct completion_filter {
+    char symbol;               /* only names starting with this, if set */
+    struct irc_channel *scope; /* only nicks in this channel, if set */
+};
+LIST_HEAD(nick_bucket, nick_entry);
+struct nick_registry {
+    struct nick_bucket *buckets;
+    size_t nbuckets;  /* power of two */
+    TAILQ_HEAD(nick_mru, nick_entry) mru;
+    struct nick_bucket free;
+    size_t count, capacity; /* the LRU nick is evicted at capacity */
+    unsigned long clock;
+    struct prefix_index index;
+};
+#define NICK_BUCKET(n) (&nicks.buckets[irc_hash(n) & (nicks.nbuckets - 1)])
+
+/* how a WHO or NAMES reply is to be shown */
+struct listing_opts {
+    bool quiet;                    /* -q: only update nicks and away flags */
+    bool by_host;                  /* -h: sort WHO on user@host */
+    char target[CHAN_NAME_MAX];    /* channel or mask asked about */
+    char pattern[LISTING_PATTERN]; /* only rows matching this glob */
+};
+enum listing_col { LC_NICK, LC_FLAGS, LC_USERHOST, LC_SERVER, LC_NAME,
+                   LC_COUNT };
+/* WHO or NAMES replies, collected until the end numeric and then shown
+ * as one table: strings go in a pool and each column is an array of pool
+ * offsets. Kept between lists, so a big /W costs no allocations twice. */
+struct listing {
+    const char *what;      /* "WHO" or "NAMES" */
+    bool quiet_default;    /* for replies nobody asked for: NAMES on JOIN */
+    bool open;             /* rows are coming in */
+    struct listing_opts cur;
+    struct listing_opts pending[LISTING_PENDING];
+    int npending;
+    char *pool;            /* offset 0 is "", for unused columns */
+    size_t used, size;
+    unsigned *cols[LC_COUNT];
+    size_t *order;         /* rows shown, in display order */
+    size_t rows, cap;
+    char *text;            /* the rendered table */
+    size_t len, text_size;
+};
+static void listing_reset(struct listing *);
+
+/* a nick in a channel */
+struct membership {
+    LIST_ENTRY(membership) by_chan; /* channel's member list, or free list */
+    LIST_ENTRY(membership) by_nick; /* nick's channel list */
+    struct irc_channel *chan;
+    struct nick_entry *nick;
+    char prefix; /* '@', '+', ... or 0 */
+};
+
+/* server output: a ring of lines paced by a token bucket (RFC 1459 8.10:
+ * two seconds per line with up to ten seconds of credit) */
+struct send_line {
+    unsigned short len;
+    bool urgent; /* PING/PONG: skips flood control */
+    char buf[IRC_LINE_MAX];
+};
+struct send_queue {
+    struct send_line lines[SENDQ_LINES];
+    int head, count;
+    size_t off;             /* bytes of the head line already written */
+    bool retry;             /* SSL_write wants the same bytes again */
+    int batch;              /* lines in those bytes, when retry is set */
+    long budget_ms;         /* flood credit, FLOOD_INTERVAL_MS per line */
+    struct timespec refilled;
+    int shown;              /* queue depth currently in the prompt */
+    char stage[16384];      /* one TLS record of coalesced lines */
+};
+
+/* event loop: epoll on Linux, poll(2) elsewhere; timers are deadlines the
+ * loop sleeps towards */
+typedef void (*ev_io_func)(int fd, int events);
+typedef void (*ev_timer_func)(void);
+struct ev_io {
+    int fd;
+    int events; /* EV_READ | EV_WRITE */
+    ev_io_func func;
+};
+struct ev_timer {
+    struct timespec when; /* CLOCK_MONOTONIC */
+    ev_timer_func func;
+    bool armed;
+};
+struct event_loop {
+    int epfd;
+    struct ev_io io[EV_MAX_FDS];
+    int nio;
+    struct ev_timer *timers[EV_MAX_TIMERS];
+    int ntimers;
+};
+static void ev_io_add(int, int, ev_io_func);
+static void ev_io_mod(int, int);
+static void ev_io_del(int);
+static void ev_timer_arm(struct ev_timer *, long);
+static void ev_timer_cancel(struct ev_timer *);
+static void srv_ready(int, int);
+static void dial_ready(int, int);
+
+enum conn_state {
+    CONN_OFFLINE,     /* waiting out the reconnect backoff */
+    CONN_CONNECTING,  /* resolving and dialing */
+    CONN_HANDSHAKE,   /* TLS */
+    CONN_REGISTERING, /* NICK/USER sent, waiting for 001 */
+    CONN_ONLINE
+};
+
+/* connecting: getaddrinfo() runs on a thread that answers over a pipe, then
+ * the addresses race with staggered starts (RFC 8305 Happy Eyeballs) */
+struct dns_query {
+    unsigned gen;
+    int fd; /* where to write the answer */
+    char host[256];
+    char port[32];
+};
+struct dns_answer {
+    unsigned gen; /* stale if it doesn't match dialer.gen */
+    int error;
+    struct addrinfo *res;
+};
+struct dial_attempt {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int fd;          /* -1 unless connecting */
+    long started_ms; /* since the lookup began */
+};
+struct dialer {
+    unsigned gen;
+    int dns_pipe[2];
+    struct timespec started;
+    struct dial_attempt addrs[DIAL_MAX_ADDRS]; /* families interleaved */
+    int naddrs, next, pending;
+};
+
+/* instrumentation: /stats shows it, -S dumps it as JSON lines */
+enum stat_timer {
+    ST_PARSESRV,
+    ST_POUT,
+    ST_LOGMSG,
+    ST_SOUT,
+    ST_SSL_READ,
+    ST_SSL_WRITE,
+    ST_RENDER,   /* readline redisplay and the terminal write */
+    ST_RELOAD,   /* rereading ~/.irclusers or ~/.irclkeywords */
+    ST_COUNT
+};
+struct histogram {
+    unsigned long count;
+    unsigned long long total_ns, max_ns;
+    unsigned long buckets[STATS_BUCKETS];
+};
+struct stats {
+    struct histogram timers[ST_COUNT];
+    unsigned long long bytes_in, bytes_out;
+    unsigned long lines_in, lines_out;
+    unsigned long lines_dropped; /* not sent: offline or queue full */
+    long lag_ms;                 /* last PING round trip, -1 if none yet */
+    struct timespec lag_sent;
+    bool lag_pending;
+    struct timespec started;
+    FILE *dump;
+};
+static void highlight_build();
+static void keywords_check();
+static void users_check();
+static void watch_check();
+static void users_reload();
+static void *arena_alloc(size_t);
+static char *arena_strdup(const char *);
+static void arena_reset();
+static void stats_start(struct timespec *);
+static void stats_stop(enum stat_timer, const struct timespec *);
+static void stats_tick();
+
+#endif /* IRCL_H */